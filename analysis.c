@@ -0,0 +1,477 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "bitmap.h"
+#include "table.h"
+
+#include "analysis.h"
+
+
+#define MAX_ITERATIONS 10000
+#define TOLERANCE 1e-12
+#define TOP_ROWS 5
+
+#define INVALID_INDEX 0xFFFFFFFF
+
+
+// the transitions into each row, as probabilities, for the power iteration
+typedef struct Incoming {
+    uint32_t *offsets;
+    uint32_t *sources;
+    double *probabilities;
+} Incoming;
+
+typedef struct Worker {
+    pthread_t thread;
+    uint32_t index;
+    struct Shared *shared;
+    double residual;
+} Worker;
+
+typedef struct Shared {
+    Table *table;
+    Analysis *analysis;
+    uint32_t num_threads;
+    Incoming incoming;
+
+    double *current;
+    double *next;
+    bool done;
+    pthread_barrier_t barrier;
+} Shared;
+
+
+static void *analysis_worker(void *arg);
+static void row_range(Shared *shared, uint32_t thread_index, uint32_t *start, uint32_t *end);
+static void row_statistics(Shared *shared, uint32_t start, uint32_t end);
+static void build_incoming(Table *table, Incoming *incoming);
+static void strongly_connected(Table *table, Analysis *analysis);
+
+
+Analysis *analysis_create(Table *table, uint32_t num_threads) {
+    if (num_threads == 0) {
+        num_threads = 1;
+    }
+    if (num_threads > table->num_rows) {
+        num_threads = table->num_rows;
+    }
+
+    Analysis *analysis = (Analysis*)calloc(1, sizeof(Analysis));
+    assert(NULL != analysis);
+
+    uint32_t num_rows = table->num_rows;
+    analysis->num_rows = num_rows;
+    analysis->entropy = (double*)calloc(num_rows, sizeof(double));
+    analysis->stationary = (double*)calloc(num_rows, sizeof(double));
+    analysis->component = (uint32_t*)calloc(num_rows, sizeof(uint32_t));
+    assert(NULL != analysis->entropy);
+    assert(NULL != analysis->stationary);
+    assert(NULL != analysis->component);
+
+    Shared shared;
+    memset(&shared, 0, sizeof(shared));
+    shared.table = table;
+    shared.analysis = analysis;
+    shared.num_threads = num_threads;
+    shared.current = (double*)malloc(num_rows * sizeof(double));
+    shared.next = (double*)malloc(num_rows * sizeof(double));
+    assert(NULL != shared.current);
+    assert(NULL != shared.next);
+    build_incoming(table, &shared.incoming);
+    pthread_barrier_init(&shared.barrier, NULL, num_threads);
+
+    // start from the uniform distribution
+    for (uint32_t row_index = 0; row_index < num_rows; row_index++) {
+        shared.current[row_index] = 1.0 / num_rows;
+    }
+
+    Worker *workers = (Worker*)calloc(num_threads, sizeof(Worker));
+    assert(NULL != workers);
+    for (uint32_t thread_index = 0; thread_index < num_threads; thread_index++) {
+        workers[thread_index].index = thread_index;
+        workers[thread_index].shared = &shared;
+    }
+
+    // the calling thread does the first share of the work itself
+    for (uint32_t thread_index = 1; thread_index < num_threads; thread_index++) {
+        int retval = pthread_create(&workers[thread_index].thread, NULL, analysis_worker, &workers[thread_index]);
+        assert(0 == retval);
+    }
+    analysis_worker(&workers[0]);
+    for (uint32_t thread_index = 1; thread_index < num_threads; thread_index++) {
+        pthread_join(workers[thread_index].thread, NULL);
+    }
+
+    memcpy(analysis->stationary, shared.current, num_rows * sizeof(double));
+
+    for (uint32_t row_index = 0; row_index < num_rows; row_index++) {
+        Row *row = &table->rows[row_index];
+        analysis->num_transitions += row->num_transitions;
+        analysis->entropy_rate += analysis->stationary[row_index] * analysis->entropy[row_index];
+
+        if (row->num_transitions == 0) {
+            analysis->num_dead_ends++;
+        } else if ((row->num_transitions == 1) && (ROW_INDEX(row->transitions[0].next_row) == row_index)) {
+            analysis->num_absorbing++;
+        }
+    }
+
+    strongly_connected(table, analysis);
+
+    free(workers);
+    pthread_barrier_destroy(&shared.barrier);
+    free(shared.incoming.offsets);
+    free(shared.incoming.sources);
+    free(shared.incoming.probabilities);
+    free(shared.current);
+    free(shared.next);
+
+    return analysis;
+}
+
+void analysis_destroy(Analysis **analysis) {
+    free((*analysis)->entropy);
+    free((*analysis)->stationary);
+    free((*analysis)->component);
+    free((*analysis)->component_size);
+    free((*analysis)->component_closed);
+    free(*analysis);
+    *analysis = NULL;
+}
+
+static void row_range(Shared *shared, uint32_t thread_index, uint32_t *start, uint32_t *end) {
+    uint64_t num_rows = shared->table->num_rows;
+    *start = (num_rows * thread_index) / shared->num_threads;
+    *end = (num_rows * (thread_index + 1)) / shared->num_threads;
+}
+
+static void *analysis_worker(void *arg) {
+    Worker *worker = (Worker*)arg;
+    Shared *shared = worker->shared;
+    Analysis *analysis = shared->analysis;
+
+    uint32_t start = 0;
+    uint32_t end = 0;
+    row_range(shared, worker->index, &start, &end);
+
+    row_statistics(shared, start, end);
+
+    // power iteration on the lazy chain (P + I) / 2, which has the same
+    // stationary distribution but converges even when P is periodic.
+    // each thread pulls the probability flowing into its own rows.
+    for (uint32_t iteration = 0; iteration < MAX_ITERATIONS; iteration++) {
+        double residual = 0.0;
+        for (uint32_t row_index = start; row_index < end; row_index++) {
+            double flow = 0.0;
+            for (uint32_t in_index = shared->incoming.offsets[row_index];
+                 in_index < shared->incoming.offsets[row_index + 1];
+                 in_index++) {
+                flow += shared->incoming.probabilities[in_index] * shared->current[shared->incoming.sources[in_index]];
+            }
+
+            // rows with no way out keep their probability
+            if (shared->table->rows[row_index].num_transitions == 0) {
+                flow += shared->current[row_index];
+            }
+
+            double next = 0.5 * (shared->current[row_index] + flow);
+            residual += fabs(next - shared->current[row_index]);
+            shared->next[row_index] = next;
+        }
+        worker->residual = residual;
+
+        pthread_barrier_wait(&shared->barrier);
+
+        // worker 0 is the start of the array of workers
+        if (worker->index == 0) {
+            Worker *workers = worker;
+            double total = 0.0;
+            for (uint32_t thread_index = 0; thread_index < shared->num_threads; thread_index++) {
+                total += workers[thread_index].residual;
+            }
+
+            double *swap = shared->current;
+            shared->current = shared->next;
+            shared->next = swap;
+
+            analysis->iterations = iteration + 1;
+            analysis->residual = total;
+            shared->done = total < TOLERANCE;
+        }
+
+        pthread_barrier_wait(&shared->barrier);
+
+        if (shared->done) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static void row_statistics(Shared *shared, uint32_t start, uint32_t end) {
+    Table *table = shared->table;
+
+    for (uint32_t row_index = start; row_index < end; row_index++) {
+        Row *row = &table->rows[row_index];
+
+        double entropy = 0.0;
+        for (uint32_t trans_index = 0; trans_index < row->num_transitions; trans_index++) {
+            double probability = (double)row->transitions[trans_index].count / row->total_transitions;
+            entropy -= probability * log2(probability);
+        }
+        shared->analysis->entropy[row_index] = entropy;
+    }
+}
+
+static void build_incoming(Table *table, Incoming *incoming) {
+    uint32_t num_rows = table->num_rows;
+
+    incoming->offsets = (uint32_t*)calloc(num_rows + 1, sizeof(uint32_t));
+    assert(NULL != incoming->offsets);
+
+    for (uint32_t row_index = 0; row_index < num_rows; row_index++) {
+        Row *row = &table->rows[row_index];
+        for (uint32_t trans_index = 0; trans_index < row->num_transitions; trans_index++) {
+            incoming->offsets[ROW_INDEX(row->transitions[trans_index].next_row) + 1]++;
+        }
+    }
+    for (uint32_t row_index = 0; row_index < num_rows; row_index++) {
+        incoming->offsets[row_index + 1] += incoming->offsets[row_index];
+    }
+
+    uint32_t num_transitions = incoming->offsets[num_rows];
+    incoming->sources = (uint32_t*)malloc((num_transitions + 1) * sizeof(uint32_t));
+    incoming->probabilities = (double*)malloc((num_transitions + 1) * sizeof(double));
+    assert(NULL != incoming->sources);
+    assert(NULL != incoming->probabilities);
+
+    uint32_t *filled = (uint32_t*)malloc((num_rows + 1) * sizeof(uint32_t));
+    assert(NULL != filled);
+    memcpy(filled, incoming->offsets, (num_rows + 1) * sizeof(uint32_t));
+
+    for (uint32_t row_index = 0; row_index < num_rows; row_index++) {
+        Row *row = &table->rows[row_index];
+        for (uint32_t trans_index = 0; trans_index < row->num_transitions; trans_index++) {
+            uint32_t next_row = ROW_INDEX(row->transitions[trans_index].next_row);
+            uint32_t slot = filled[next_row]++;
+            incoming->sources[slot] = row_index;
+            incoming->probabilities[slot] = (double)row->transitions[trans_index].count / row->total_transitions;
+        }
+    }
+
+    free(filled);
+}
+
+// tarjan's algorithm, with an explicit stack so long chains of rows do not
+// overflow the call stack
+static void strongly_connected(Table *table, Analysis *analysis) {
+    uint32_t num_rows = table->num_rows;
+
+    uint32_t *order = (uint32_t*)malloc(num_rows * sizeof(uint32_t));
+    uint32_t *low = (uint32_t*)malloc(num_rows * sizeof(uint32_t));
+    uint32_t *next_edge = (uint32_t*)calloc(num_rows, sizeof(uint32_t));
+    uint32_t *stack = (uint32_t*)malloc(num_rows * sizeof(uint32_t));
+    uint32_t *calls = (uint32_t*)malloc(num_rows * sizeof(uint32_t));
+    bool *on_stack = (bool*)calloc(num_rows, sizeof(bool));
+    assert((NULL != order) && (NULL != low) && (NULL != next_edge));
+    assert((NULL != stack) && (NULL != calls) && (NULL != on_stack));
+
+    for (uint32_t row_index = 0; row_index < num_rows; row_index++) {
+        order[row_index] = INVALID_INDEX;
+    }
+
+    uint32_t num_visited = 0;
+    uint32_t stack_size = 0;
+    uint32_t num_components = 0;
+
+    for (uint32_t root = 0; root < num_rows; root++) {
+        if (order[root] != INVALID_INDEX) {
+            continue;
+        }
+
+        uint32_t num_calls = 0;
+        calls[num_calls++] = root;
+        order[root] = low[root] = num_visited++;
+        stack[stack_size++] = root;
+        on_stack[root] = true;
+
+        while (num_calls > 0) {
+            uint32_t row_index = calls[num_calls - 1];
+            Row *row = &table->rows[row_index];
+
+            if (next_edge[row_index] < row->num_transitions) {
+                uint32_t next_row = ROW_INDEX(row->transitions[next_edge[row_index]].next_row);
+                next_edge[row_index]++;
+
+                if (order[next_row] == INVALID_INDEX) {
+                    order[next_row] = low[next_row] = num_visited++;
+                    stack[stack_size++] = next_row;
+                    on_stack[next_row] = true;
+                    calls[num_calls++] = next_row;
+                } else if (on_stack[next_row] && (order[next_row] < low[row_index])) {
+                    low[row_index] = order[next_row];
+                }
+                continue;
+            }
+
+            // all edges done- pop this row, and its component if it is the root
+            num_calls--;
+            if (num_calls > 0) {
+                uint32_t parent = calls[num_calls - 1];
+                if (low[row_index] < low[parent]) {
+                    low[parent] = low[row_index];
+                }
+            }
+
+            if (low[row_index] == order[row_index]) {
+                uint32_t member = INVALID_INDEX;
+                do {
+                    member = stack[--stack_size];
+                    on_stack[member] = false;
+                    analysis->component[member] = num_components;
+                } while (member != row_index);
+                num_components++;
+            }
+        }
+    }
+
+    analysis->num_components = num_components;
+    analysis->component_size = (uint32_t*)calloc(num_components, sizeof(uint32_t));
+    analysis->component_closed = (bool*)malloc(num_components * sizeof(bool));
+    assert(NULL != analysis->component_size);
+    assert(NULL != analysis->component_closed);
+
+    for (uint32_t component = 0; component < num_components; component++) {
+        analysis->component_closed[component] = true;
+    }
+
+    for (uint32_t row_index = 0; row_index < num_rows; row_index++) {
+        uint32_t component = analysis->component[row_index];
+        analysis->component_size[component]++;
+
+        Row *row = &table->rows[row_index];
+        for (uint32_t trans_index = 0; trans_index < row->num_transitions; trans_index++) {
+            if (analysis->component[ROW_INDEX(row->transitions[trans_index].next_row)] != component) {
+                analysis->component_closed[component] = false;
+            }
+        }
+    }
+
+    for (uint32_t component = 0; component < num_components; component++) {
+        if (analysis->component_size[component] > analysis->largest_component) {
+            analysis->largest_component = analysis->component_size[component];
+        }
+        analysis->num_closed += analysis->component_closed[component];
+    }
+
+    free(order);
+    free(low);
+    free(next_edge);
+    free(stack);
+    free(calls);
+    free(on_stack);
+}
+
+void analysis_print(Analysis *analysis, Table *table) {
+    double max_entropy = 0.0;
+    double mean_degree = (double)analysis->num_transitions / analysis->num_rows;
+    for (uint32_t row_index = 0; row_index < analysis->num_rows; row_index++) {
+        if (analysis->entropy[row_index] > max_entropy) {
+            max_entropy = analysis->entropy[row_index];
+        }
+    }
+
+    printf("Rows:                %d (width %d, %d bits per cell)\n",
+           analysis->num_rows, table->row_width, table->bits_per_cell);
+    printf("Transitions:         %llu (%.2f per row)\n",
+           (unsigned long long)analysis->num_transitions, mean_degree);
+    printf("Dead ends:           %d\n", analysis->num_dead_ends);
+    printf("Absorbing rows:      %d\n", analysis->num_absorbing);
+    printf("Components:          %d (largest %d rows, %d closed)\n",
+           analysis->num_components, analysis->largest_component, analysis->num_closed);
+    printf("Entropy rate:        %.4f bits per row (max %.4f for one row)\n",
+           analysis->entropy_rate, max_entropy);
+    printf("Stationary solve:    %d iterations, residual %.3g\n",
+           analysis->iterations, analysis->residual);
+
+    // the few most visited rows, found with a partial selection
+    uint32_t top[TOP_ROWS];
+    uint32_t num_top = 0;
+    for (uint32_t row_index = 0; row_index < analysis->num_rows; row_index++) {
+        uint32_t position = num_top;
+        while ((position > 0) && (analysis->stationary[top[position - 1]] < analysis->stationary[row_index])) {
+            if (position < TOP_ROWS) {
+                top[position] = top[position - 1];
+            }
+            position--;
+        }
+        if (position < TOP_ROWS) {
+            top[position] = row_index;
+            if (num_top < TOP_ROWS) {
+                num_top++;
+            }
+        }
+    }
+
+    char string[65];
+    printf("Most visited rows:\n");
+    for (uint32_t top_index = 0; top_index < num_top; top_index++) {
+        uint32_t row_index = top[top_index];
+        table_row_string(table, row_index, string);
+        string[table->row_width] = '\0';
+        printf("  %s  %.4f\n", string, analysis->stationary[row_index]);
+    }
+}
+
+bool analysis_write_json(Analysis *analysis, Table *table, char const *file_name) {
+    FILE *file = fopen(file_name, "w");
+    if (NULL == file) {
+        return false;
+    }
+
+    fprintf(file, "{\n");
+    fprintf(file, "  \"rows\": %d,\n", analysis->num_rows);
+    fprintf(file, "  \"width\": %d,\n", table->row_width);
+    fprintf(file, "  \"bits_per_cell\": %d,\n", table->bits_per_cell);
+    fprintf(file, "  \"transitions\": %llu,\n", (unsigned long long)analysis->num_transitions);
+    fprintf(file, "  \"dead_ends\": %d,\n", analysis->num_dead_ends);
+    fprintf(file, "  \"absorbing\": %d,\n", analysis->num_absorbing);
+    fprintf(file, "  \"entropy_rate\": %.17g,\n", analysis->entropy_rate);
+    fprintf(file, "  \"iterations\": %d,\n", analysis->iterations);
+    fprintf(file, "  \"residual\": %.17g,\n", analysis->residual);
+
+    fprintf(file, "  \"components\": [");
+    for (uint32_t component = 0; component < analysis->num_components; component++) {
+        fprintf(file, "%s\n    {\"size\": %d, \"closed\": %s}",
+                component == 0 ? "" : ",",
+                analysis->component_size[component],
+                analysis->component_closed[component] ? "true" : "false");
+    }
+    fprintf(file, "\n  ],\n");
+
+    char string[65];
+    fprintf(file, "  \"states\": [");
+    for (uint32_t row_index = 0; row_index < analysis->num_rows; row_index++) {
+        Row *row = &table->rows[row_index];
+        table_row_string(table, row_index, string);
+        string[table->row_width] = '\0';
+
+        fprintf(file, "%s\n    {\"row\": \"%s\", \"out_degree\": %d, \"count\": %d, "
+                      "\"entropy\": %.17g, \"stationary\": %.17g, \"component\": %d}",
+                row_index == 0 ? "" : ",",
+                string, row->num_transitions, row->total_transitions,
+                analysis->entropy[row_index], analysis->stationary[row_index],
+                analysis->component[row_index]);
+    }
+    fprintf(file, "\n  ]\n");
+    fprintf(file, "}\n");
+
+    return 0 == fclose(file);
+}
@@ -0,0 +1,44 @@
+#ifndef DOWNGEN_ANALYSIS
+#define DOWNGEN_ANALYSIS
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "table.h"
+
+
+// properties of the markov chain a table describes, all computed from the
+// sparse transitions so large tables can be checked
+typedef struct Analysis {
+    uint32_t num_rows;
+    uint64_t num_transitions;
+
+    // per row
+    double *entropy;      // bits of randomness in choosing the next row
+    double *stationary;   // long run fraction of generated rows
+    uint32_t *component;  // strongly connected component of the row
+
+    uint32_t num_dead_ends;   // rows with no transitions
+    uint32_t num_absorbing;   // rows that only transition to themselves
+
+    // per strongly connected component
+    uint32_t num_components;
+    uint32_t *component_size;
+    bool *component_closed;   // no transitions leave the component
+    uint32_t largest_component;
+    uint32_t num_closed;
+
+    double entropy_rate;
+    uint32_t iterations;
+    double residual;
+} Analysis;
+
+
+// the caller holds the table's read lock
+Analysis *analysis_create(Table *table, uint32_t num_threads);
+void analysis_destroy(Analysis **analysis);
+
+void analysis_print(Analysis *analysis, Table *table);
+bool analysis_write_json(Analysis *analysis, Table *table, char const *file_name);
+
+#endif
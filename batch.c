@@ -0,0 +1,246 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include "rng.h"
+#include "table.h"
+
+#include "batch.h"
+
+
+static void build_alias(Sampler *sampler, Row *row, uint32_t row_index, uint64_t *weights,
+                        uint32_t *small, uint32_t *large);
+static void check_novelty(Batch *batch, uint32_t block, uint32_t const *rows);
+
+
+Sampler *sampler_create(Table *table) {
+    Sampler *sampler = (Sampler*)calloc(1, sizeof(Sampler));
+    assert(NULL != sampler);
+
+    uint32_t num_rows = table->num_rows;
+    sampler->num_rows = num_rows;
+    sampler->rows = (SamplerRow*)malloc(num_rows * sizeof(SamplerRow));
+    assert(NULL != sampler->rows);
+
+    // rows without transitions get a single slot pointing back at themselves
+    uint32_t num_slots = 0;
+    uint32_t max_transitions = 1;
+    for (uint32_t row_index = 0; row_index < num_rows; row_index++) {
+        uint32_t size = table->rows[row_index].num_transitions;
+        if (size == 0) {
+            size = 1;
+        }
+        if (size > max_transitions) {
+            max_transitions = size;
+        }
+
+        sampler->rows[row_index].offset = num_slots;
+        sampler->rows[row_index].size = size;
+        num_slots += size;
+    }
+
+    sampler->slots = (SamplerSlot*)malloc(num_slots * sizeof(SamplerSlot));
+    assert(NULL != sampler->slots);
+
+    uint64_t *weights = (uint64_t*)malloc(max_transitions * sizeof(uint64_t));
+    uint32_t *small = (uint32_t*)malloc(max_transitions * sizeof(uint32_t));
+    uint32_t *large = (uint32_t*)malloc(max_transitions * sizeof(uint32_t));
+    assert((NULL != weights) && (NULL != small) && (NULL != large));
+
+    for (uint32_t row_index = 0; row_index < num_rows; row_index++) {
+        build_alias(sampler, &table->rows[row_index], row_index, weights, small, large);
+    }
+
+    free(weights);
+    free(small);
+    free(large);
+
+    return sampler;
+}
+
+// vose's alias method in integers. every slot holds total_transitions worth
+// of probability- a draw u below its threshold picks the slot's own row,
+// and otherwise its alias.
+static void build_alias(Sampler *sampler, Row *row, uint32_t row_index, uint64_t *weights,
+                        uint32_t *small, uint32_t *large) {
+    SamplerSlot *slots = &sampler->slots[sampler->rows[row_index].offset];
+    uint32_t size = row->num_transitions;
+
+    if (size == 0) {
+        sampler->rows[row_index].total = 1;
+        slots[0].threshold = 1;
+        slots[0].primary = row_index;
+        slots[0].alias = row_index;
+        return;
+    }
+
+    uint64_t total = row->total_transitions;
+    sampler->rows[row_index].total = row->total_transitions;
+
+    uint32_t num_small = 0;
+    uint32_t num_large = 0;
+    for (uint32_t trans_index = 0; trans_index < size; trans_index++) {
+        weights[trans_index] = (uint64_t)row->transitions[trans_index].count * size;
+        slots[trans_index].primary = row->transitions[trans_index].next_row;
+
+        if (weights[trans_index] < total) {
+            small[num_small++] = trans_index;
+        } else {
+            large[num_large++] = trans_index;
+        }
+    }
+
+    while ((num_small > 0) && (num_large > 0)) {
+        uint32_t less = small[--num_small];
+        uint32_t more = large[num_large - 1];
+
+        slots[less].threshold = weights[less];
+        slots[less].alias = row->transitions[more].next_row;
+
+        weights[more] -= total - weights[less];
+        if (weights[more] < total) {
+            num_large--;
+            small[num_small++] = more;
+        }
+    }
+
+    // whatever is left is full
+    while (num_large > 0) {
+        uint32_t slot = large[--num_large];
+        slots[slot].threshold = total;
+        slots[slot].alias = slots[slot].primary;
+    }
+    while (num_small > 0) {
+        uint32_t slot = small[--num_small];
+        slots[slot].threshold = total;
+        slots[slot].alias = slots[slot].primary;
+    }
+}
+
+void sampler_destroy(Sampler **sampler) {
+    free((*sampler)->rows);
+    free((*sampler)->slots);
+    free(*sampler);
+    *sampler = NULL;
+}
+
+Batch *batch_create(Table *table, uint32_t num_chains, uint64_t seed) {
+    Batch *batch = (Batch*)calloc(1, sizeof(Batch));
+    assert(NULL != batch);
+
+    // round up to whole blocks, so batch_step has no partial block
+    uint32_t num_slots = ((num_chains + BATCH_LANES - 1) / BATCH_LANES) * BATCH_LANES;
+
+    batch->num_chains = num_chains;
+    batch->current_rows = (uint32_t*)calloc(num_slots, sizeof(uint32_t));
+    batch->rng_states = (uint64_t*)calloc(num_slots, sizeof(uint64_t));
+    assert(NULL != batch->current_rows);
+    assert(NULL != batch->rng_states);
+
+    batch->sampler = sampler_create(table);
+
+    if (NULL != table->novelty) {
+        batch->table = table;
+        batch->matches = (NoveltyMatch*)malloc(num_slots * sizeof(NoveltyMatch));
+        assert(NULL != batch->matches);
+        for (uint32_t chain = 0; chain < num_slots; chain++) {
+            novelty_start(&batch->matches[chain]);
+        }
+    }
+
+    Rng seeder;
+    rng_seed(&seeder, seed);
+    for (uint32_t chain = 0; chain < num_slots; chain++) {
+        Rng rng;
+        rng_seed(&rng, ((uint64_t)rng_next(&seeder) << 32) | rng_next(&seeder));
+        batch->current_rows[chain] = rng_next(&rng) % table->num_rows;
+        batch->rng_states[chain] = rng.state;
+    }
+
+    return batch;
+}
+
+void batch_destroy(Batch **batch) {
+    sampler_destroy(&(*batch)->sampler);
+    free((*batch)->current_rows);
+    free((*batch)->rng_states);
+    free((*batch)->matches);
+    free(*batch);
+    *batch = NULL;
+}
+
+// each block of lanes goes through the same few simple loops, so that the
+// compiler can vectorize the arithmetic, and the loads for one lane are in
+// flight at the same time as the loads for the others
+void batch_step(Batch *batch, uint32_t *rows) {
+    Sampler *sampler = batch->sampler;
+
+    for (uint32_t block = 0; block < batch->num_chains; block += BATCH_LANES) {
+        uint32_t *current = &batch->current_rows[block];
+        uint64_t *states = &batch->rng_states[block];
+
+        uint64_t random[BATCH_LANES];
+        uint32_t slot[BATCH_LANES];
+        uint32_t draw[BATCH_LANES];
+        uint32_t next[BATCH_LANES];
+
+        for (uint32_t lane = 0; lane < BATCH_LANES; lane++) {
+            states[lane] += RNG_INCREMENT;
+            random[lane] = rng_mix(states[lane]);
+        }
+
+        // pick a slot with the high half of the random number and a point
+        // within it with the low half
+        for (uint32_t lane = 0; lane < BATCH_LANES; lane++) {
+            SamplerRow *row = &sampler->rows[ROW_INDEX(current[lane])];
+            uint64_t size = row->size;
+            uint64_t total = row->total;
+
+            slot[lane] = row->offset + (uint32_t)(((random[lane] >> 32) * size) >> 32);
+            draw[lane] = (uint32_t)(((random[lane] & 0xFFFFFFFF) * total) >> 32);
+        }
+
+        for (uint32_t lane = 0; lane < BATCH_LANES; lane++) {
+            SamplerSlot *sampled = &sampler->slots[slot[lane]];
+            next[lane] = draw[lane] < sampled->threshold ? sampled->primary : sampled->alias;
+        }
+
+        for (uint32_t lane = 0; lane < BATCH_LANES; lane++) {
+            uint32_t next_row = next[lane] ^ (current[lane] & ROW_MIRRORED);
+            __builtin_prefetch(&sampler->rows[ROW_INDEX(next_row)]);
+
+            if ((block + lane) < batch->num_chains) {
+                rows[block + lane] = current[lane];
+            }
+            current[lane] = next_row;
+        }
+
+        if (NULL != batch->table) {
+            check_novelty(batch, block, rows);
+        }
+    }
+}
+
+// redraw the rows that would copy too much of a trained level, one lane at
+// a time. most draws are fine, so this is one lookup per lane.
+static void check_novelty(Batch *batch, uint32_t block, uint32_t const *rows) {
+    Novelty *novelty = batch->table->novelty;
+
+    for (uint32_t lane = 0; lane < BATCH_LANES; lane++) {
+        uint32_t chain = block + lane;
+        if (chain >= batch->num_chains) {
+            break;
+        }
+
+        NoveltyMatch *match = &batch->matches[chain];
+        novelty_advance(novelty, match, rows[chain]);
+
+        if (!novelty_allows(novelty, match, batch->current_rows[chain])) {
+            Rng rng = { batch->rng_states[chain] };
+            batch->current_rows[chain] = table_next_novel_row(batch->table, &rng, rows[chain], match);
+            batch->rng_states[chain] = rng.state;
+        }
+    }
+}
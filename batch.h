@@ -0,0 +1,63 @@
+#ifndef DOWNGEN_BATCH
+#define DOWNGEN_BATCH
+
+#include <stdint.h>
+
+#include "table.h"
+
+
+// the number of chains advanced together in one block
+#define BATCH_LANES 8
+
+
+typedef struct SamplerRow {
+    uint32_t offset;
+    uint32_t size;
+    uint32_t total;
+} SamplerRow;
+
+typedef struct SamplerSlot {
+    uint32_t threshold;
+    uint32_t primary;
+    uint32_t alias;
+} SamplerSlot;
+
+// a flat alias table for every row of a table, so that sampling the next
+// row is two lookups with no search. each lookup is one small struct, so
+// one cache miss at most.
+typedef struct Sampler {
+    uint32_t num_rows;
+    SamplerRow *rows;
+    SamplerSlot *slots;
+} Sampler;
+
+// many independent walks through the same table, stored as arrays of
+// their states so they can be advanced together
+typedef struct Batch {
+    uint32_t num_chains;
+    uint32_t *current_rows;
+    uint64_t *rng_states;
+    Sampler *sampler;
+
+    // the table, and each chain's rows copied from a trained level, when
+    // the table has a novelty index. otherwise NULL.
+    Table *table;
+    NoveltyMatch *matches;
+} Batch;
+
+
+// the caller holds the table's read lock while the sampler is built. the
+// sampler is a snapshot, so later training does not change it.
+Sampler *sampler_create(Table *table);
+void sampler_destroy(Sampler **sampler);
+
+// chain i is seeded from seed and i, and starts at a random row
+Batch *batch_create(Table *table, uint32_t num_chains, uint64_t seed);
+void batch_destroy(Batch **batch);
+
+// advance every chain by one row, writing the row each chain was on before
+// the step into rows[chain]. when the table has a novelty index, the caller
+// must hold the table's read lock while stepping.
+void batch_step(Batch *batch, uint32_t *rows);
+
+#endif
@@ -0,0 +1,158 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "bitmap.h"
+
+
+#define ONES 0x0101010101010101ULL
+
+
+static Bitmap pack_bytes(uint32_t width, char const *row);
+static void unpack_bytes(uint32_t width, Bitmap bitmap, uint8_t *cells);
+static inline Bitmap pack_symbols(uint32_t width, uint32_t bits, char const *row);
+static inline void unpack_symbols(uint32_t width, uint32_t bits, Bitmap bitmap, uint8_t *cells);
+
+
+int bitmap_symbol(char cell) {
+    if ((cell >= '0') && (cell <= '9')) {
+        return cell - '0';
+    }
+    if ((cell >= 'A') && (cell <= 'F')) {
+        return cell - 'A' + 10;
+    }
+    if ((cell >= 'a') && (cell <= 'f')) {
+        return cell - 'a' + 10;
+    }
+    return -1;
+}
+
+char bitmap_cell(uint8_t symbol) {
+    return "0123456789ABCDEF"[symbol & (MAX_SYMBOLS - 1)];
+}
+
+uint32_t bitmap_cell_bits(uint32_t width, uint32_t height, char const * const level) {
+    int max_symbol = 0;
+    for (uint32_t index = 0; index < (width * height); index++) {
+        int symbol = bitmap_symbol(level[index]);
+        if (symbol > max_symbol) {
+            max_symbol = symbol;
+        }
+    }
+
+    if (max_symbol < 2) {
+        return 1;
+    } else if (max_symbol < 4) {
+        return 2;
+    }
+    return 4;
+}
+
+// reverse the whole word by swapping ever larger halves, skipping the swaps
+// that would reverse the bits within a cell, then shift the row back down
+Bitmap bitmap_mirror(Bitmap bitmap, uint32_t width, uint32_t bits_per_cell) {
+    uint64_t x = bitmap;
+
+    if (bits_per_cell < 2) {
+        x = ((x >> 1) & 0x5555555555555555ULL) | ((x & 0x5555555555555555ULL) << 1);
+    }
+    if (bits_per_cell < 4) {
+        x = ((x >> 2) & 0x3333333333333333ULL) | ((x & 0x3333333333333333ULL) << 2);
+    }
+    x = ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((x & 0x0F0F0F0F0F0F0F0FULL) << 4);
+    x = __builtin_bswap64(x);
+
+    return x >> (64 - (width * bits_per_cell));
+}
+
+// pack eight characters at a time. '0' is even and '1' is odd, so the low
+// bit of each byte is the cell, and the multiply gathers those eight bits
+// into the top byte, with the first character highest.
+static Bitmap pack_bytes(uint32_t width, char const *row) {
+    Bitmap map = 0;
+    uint32_t index = 0;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; (index + 8) <= width; index += 8) {
+        uint64_t chars;
+        memcpy(&chars, &row[index], sizeof(chars));
+        map = (map << 8) | (((chars & ONES) * 0x8040201008040201ULL) >> 56);
+    }
+#endif
+
+    for (; index < width; index++) {
+        map = map << 1;
+        map |= row[index] == '1';
+    }
+
+    return map;
+}
+
+// the reverse of pack_bytes- spread each byte of the bitmap over eight
+// bytes, then turn each nonzero byte into a 1
+static void unpack_bytes(uint32_t width, Bitmap bitmap, uint8_t *cells) {
+    uint32_t index = 0;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; (index + 8) <= width; index += 8) {
+        uint64_t bits = (bitmap >> (width - index - 8)) & 0xFF;
+        uint64_t spread = (bits * ONES) & 0x0102040810204080ULL;
+        uint64_t bytes = ((spread + 0x7F7F7F7F7F7F7F7FULL) >> 7) & ONES;
+        memcpy(&cells[index], &bytes, sizeof(bytes));
+    }
+#endif
+
+    for (; index < width; index++) {
+        Bitmap mask = (Bitmap)1 << (width - index - 1);
+        cells[index] = (mask & bitmap) != 0;
+    }
+}
+
+// multi-bit cells- width * bits is at most 64, so at most 32 cells
+static inline Bitmap pack_symbols(uint32_t width, uint32_t bits, char const *row) {
+    Bitmap map = 0;
+
+    for (uint32_t index = 0; index < width; index++) {
+        map = map << bits;
+        map |= (Bitmap)bitmap_symbol(row[index]);
+    }
+
+    return map;
+}
+
+static inline void unpack_symbols(uint32_t width, uint32_t bits, Bitmap bitmap, uint8_t *cells) {
+    Bitmap mask = ((Bitmap)1 << bits) - 1;
+
+    for (uint32_t index = 0; index < width; index++) {
+        cells[index] = (bitmap >> ((width - index - 1) * bits)) & mask;
+    }
+}
+
+#define SYMBOL_KERNELS(BITS)                                                           \
+    static Bitmap pack_bits_##BITS(uint32_t width, char const *row) {                  \
+        return pack_symbols(width, BITS, row);                                         \
+    }                                                                                  \
+    static void unpack_bits_##BITS(uint32_t width, Bitmap bitmap, uint8_t *cells) {    \
+        unpack_symbols(width, BITS, bitmap, cells);                                    \
+    }
+
+SYMBOL_KERNELS(2)
+SYMBOL_KERNELS(4)
+
+BitmapKernels bitmap_kernels(uint32_t width, uint32_t bits_per_cell) {
+    (void)width;
+    BitmapKernels kernels;
+
+    if (bits_per_cell == 2) {
+        kernels.pack = pack_bits_2;
+        kernels.unpack = unpack_bits_2;
+        return kernels;
+    } else if (bits_per_cell == 4) {
+        kernels.pack = pack_bits_4;
+        kernels.unpack = unpack_bits_4;
+        return kernels;
+    }
+
+    kernels.pack = pack_bytes;
+    kernels.unpack = unpack_bytes;
+    return kernels;
+}
@@ -0,0 +1,41 @@
+#ifndef DOWNGEN_BITMAP
+#define DOWNGEN_BITMAP
+
+#include <stdint.h>
+
+
+// the largest number of tile types a cell can hold
+#define MAX_SYMBOLS 16
+
+// a row of the level, packed at 1, 2 or 4 bits per cell with the leftmost
+// cell in the highest used bits
+typedef uint64_t Bitmap;
+
+// pack width cell characters ('0'-'9', 'A'-'F') into a bitmap
+typedef Bitmap (*BitmapPackFn)(uint32_t width, char const *row);
+// unpack a bitmap into width palette indices, one byte per cell
+typedef void (*BitmapUnpackFn)(uint32_t width, Bitmap bitmap, uint8_t *cells);
+
+typedef struct BitmapKernels {
+    BitmapPackFn pack;
+    BitmapUnpackFn unpack;
+} BitmapKernels;
+
+
+// choose the kernels for rows of the given width and bits per cell. one bit
+// cells are packed eight at a time whatever the width, and wider cells one
+// at a time.
+BitmapKernels bitmap_kernels(uint32_t width, uint32_t bits_per_cell);
+
+// the tile type of a cell character, or -1 if it is not a valid cell
+int bitmap_symbol(char cell);
+// the cell character for a tile type
+char bitmap_cell(uint8_t symbol);
+
+// reverse the order of the cells in a bitmap, keeping each cell's bits
+Bitmap bitmap_mirror(Bitmap bitmap, uint32_t width, uint32_t bits_per_cell);
+
+// the fewest bits per cell (1, 2 or 4) that hold every cell of the level
+uint32_t bitmap_cell_bits(uint32_t width, uint32_t height, char const * const level);
+
+#endif
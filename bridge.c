@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+#include "rng.h"
+#include "bitmap.h"
+#include "table.h"
+
+#include "bridge.h"
+
+
+#define STATE(table, row) ((table)->mirror ? (ROW_INDEX(row) << 1) | ((row) >> 31) : (row))
+#define STATE_ROW(table, state) ((table)->mirror ? ((state) >> 1) | ((state) << 31) : (state))
+
+
+static int compare_states(void const *left, void const *right);
+static uint32_t symmetric_twin(Table *table, uint32_t row);
+static uint64_t find_state(Bridge *bridge, uint32_t step, uint32_t state);
+static uint32_t sample_weighted(Rng *rng, double *weights, uint32_t num_weights);
+
+
+static int compare_states(void const *left, void const *right) {
+    uint32_t a = *(uint32_t const*)left;
+    uint32_t b = *(uint32_t const*)right;
+    return (a > b) - (a < b);
+}
+
+// in a mirrored table, a row that is its own mirror image is two states
+// with the same tiles. returns the other one, or INVALID_ROW if the row has
+// no twin.
+static uint32_t symmetric_twin(Table *table, uint32_t row) {
+    if (!table->mirror || (INVALID_ROW == row)) {
+        return INVALID_ROW;
+    }
+    Bitmap bitmap = table->rows[ROW_INDEX(row)].bitmap;
+    if (bitmap_mirror(bitmap, table->row_width, table->bits_per_cell) != bitmap) {
+        return INVALID_ROW;
+    }
+    return row ^ ROW_MIRRORED;
+}
+
+// the forward pass marks the states the walk can reach at each step, one
+// bit per state. the backward pass then finds the chance of reaching the
+// end from each of them, keeping only those where it is not zero. these
+// are the states on some walk between the two rows, and are usually far
+// fewer than the table's.
+Bridge *bridge_create(Table *table, uint32_t start_row, uint32_t end_row, uint32_t length) {
+    assert(length > 0);
+
+    uint32_t num_states = table->num_rows * (table->mirror ? 2 : 1);
+    uint64_t num_words = (num_states + 63) / 64;
+
+    uint64_t *reachable = (uint64_t*)calloc((uint64_t)length * num_words, sizeof(uint64_t));
+    assert(NULL != reachable);
+
+    if (INVALID_ROW == start_row) {
+        for (uint32_t row_index = 0; row_index < table->num_rows; row_index++) {
+            uint32_t state = STATE(table, row_index);
+            reachable[state / 64] |= 1ULL << (state % 64);
+        }
+    } else {
+        uint32_t state = STATE(table, start_row);
+        reachable[state / 64] |= 1ULL << (state % 64);
+
+        uint32_t twin = symmetric_twin(table, start_row);
+        if (INVALID_ROW != twin) {
+            state = STATE(table, twin);
+            reachable[state / 64] |= 1ULL << (state % 64);
+        }
+    }
+
+    for (uint32_t step = 1; step < length; step++) {
+        uint64_t *current = &reachable[(uint64_t)(step - 1) * num_words];
+        uint64_t *next = &reachable[(uint64_t)step * num_words];
+
+        for (uint64_t word = 0; word < num_words; word++) {
+            for (uint64_t bits = current[word]; bits != 0; bits &= bits - 1) {
+                uint32_t from = STATE_ROW(table, (uint32_t)(word * 64 + __builtin_ctzll(bits)));
+                Row *row = &table->rows[ROW_INDEX(from)];
+
+                for (uint32_t trans_index = 0; trans_index < row->num_transitions; trans_index++) {
+                    uint32_t state = STATE(table, row->transitions[trans_index].next_row ^ (from & ROW_MIRRORED));
+                    next[state / 64] |= 1ULL << (state % 64);
+                }
+            }
+        }
+    }
+
+    Bridge *bridge = (Bridge*)calloc(1, sizeof(Bridge));
+    assert(NULL != bridge);
+    bridge->length = length;
+    bridge->start_row = start_row;
+    bridge->end_row = end_row;
+
+    bridge->offsets = (uint64_t*)malloc(length * sizeof(uint64_t));
+    bridge->sizes = (uint32_t*)malloc(length * sizeof(uint32_t));
+    assert((NULL != bridge->offsets) && (NULL != bridge->sizes));
+
+    uint64_t capacity = 1024;
+    uint64_t num_entries = 0;
+    bridge->states = (uint32_t*)malloc(capacity * sizeof(uint32_t));
+    bridge->reach = (double*)malloc(capacity * sizeof(double));
+    assert((NULL != bridge->states) && (NULL != bridge->reach));
+
+    uint32_t end_twin = symmetric_twin(table, end_row);
+
+    // the chance of reaching the end row from each state at the next step
+    double *next_reach = (double*)calloc(num_states, sizeof(double));
+    assert(NULL != next_reach);
+
+    // steps are filled in from the last back to the first. each is rescaled
+    // so long bridges do not underflow, which leaves the ratios used for
+    // sampling alone.
+    bool connected = true;
+    for (uint32_t step = length; connected && (step > 0); step--) {
+        uint64_t *current = &reachable[(uint64_t)(step - 1) * num_words];
+        bridge->offsets[step - 1] = num_entries;
+
+        double largest = 0.0;
+        for (uint64_t word = 0; word < num_words; word++) {
+            for (uint64_t bits = current[word]; bits != 0; bits &= bits - 1) {
+                uint32_t state = (uint32_t)(word * 64 + __builtin_ctzll(bits));
+                uint32_t from = STATE_ROW(table, state);
+
+                double sum = 0.0;
+                if (step == length) {
+                    sum = ((INVALID_ROW == end_row) || (from == end_row) || (from == end_twin)) ? 1.0 : 0.0;
+                } else if (table->rows[ROW_INDEX(from)].total_transitions > 0) {
+                    Row *row = &table->rows[ROW_INDEX(from)];
+                    for (uint32_t trans_index = 0; trans_index < row->num_transitions; trans_index++) {
+                        uint32_t next = row->transitions[trans_index].next_row ^ (from & ROW_MIRRORED);
+                        sum += row->transitions[trans_index].count * next_reach[STATE(table, next)];
+                    }
+                    sum /= row->total_transitions;
+                }
+                if (sum <= 0.0) {
+                    continue;
+                }
+
+                if (num_entries == capacity) {
+                    capacity *= 2;
+                    bridge->states = (uint32_t*)realloc(bridge->states, capacity * sizeof(uint32_t));
+                    bridge->reach = (double*)realloc(bridge->reach, capacity * sizeof(double));
+                    assert((NULL != bridge->states) && (NULL != bridge->reach));
+                }
+                bridge->states[num_entries] = state;
+                bridge->reach[num_entries] = sum;
+                num_entries++;
+
+                if (sum > largest) {
+                    largest = sum;
+                }
+            }
+        }
+
+        uint64_t begin = bridge->offsets[step - 1];
+        bridge->sizes[step - 1] = num_entries - begin;
+        connected = num_entries > begin;
+
+        // this step's values are what the step before it looks up
+        if (step < length) {
+            uint64_t next_begin = bridge->offsets[step];
+            for (uint64_t index = next_begin; index < next_begin + bridge->sizes[step]; index++) {
+                next_reach[bridge->states[index]] = 0.0;
+            }
+        }
+        for (uint64_t index = begin; index < num_entries; index++) {
+            bridge->reach[index] /= largest;
+            next_reach[bridge->states[index]] = bridge->reach[index];
+        }
+    }
+
+    free(next_reach);
+    free(reachable);
+
+    if (!connected) {
+        bridge_destroy(&bridge);
+    }
+
+    return bridge;
+}
+
+void bridge_destroy(Bridge **bridge) {
+    free((*bridge)->offsets);
+    free((*bridge)->sizes);
+    free((*bridge)->states);
+    free((*bridge)->reach);
+    free(*bridge);
+    *bridge = NULL;
+}
+
+// the index of a state among those kept for a step, or the end of the step
+// if it is not one of them
+static uint64_t find_state(Bridge *bridge, uint32_t step, uint32_t state) {
+    uint32_t *states = &bridge->states[bridge->offsets[step]];
+    uint32_t *found = (uint32_t*)bsearch(&state, states, bridge->sizes[step], sizeof(uint32_t), compare_states);
+    return bridge->offsets[step] + (NULL == found ? bridge->sizes[step] : (uint64_t)(found - states));
+}
+
+// rounding can leave the draw past the end, which goes to the last choice
+// that is possible at all
+static uint32_t sample_weighted(Rng *rng, double *weights, uint32_t num_weights) {
+    double total = 0.0;
+    uint32_t last = 0;
+    for (uint32_t index = 0; index < num_weights; index++) {
+        total += weights[index];
+        if (weights[index] > 0.0) {
+            last = index;
+        }
+    }
+
+    double draw = (rng_next(rng) + 0.5) / 4294967296.0 * total;
+    for (uint32_t index = 0; index < last; index++) {
+        if (draw < weights[index]) {
+            return index;
+        }
+        draw -= weights[index];
+    }
+    return last;
+}
+
+// each row follows the last with its chance in the table, times the chance
+// of reaching the end row from it. the first row is drawn from the states
+// of the first step, which are every row for a free start and both
+// orientations of a symmetric start row.
+void bridge_sample(Bridge *bridge, Table *table, Rng *rng, uint32_t *rows) {
+    uint64_t begin = bridge->offsets[0];
+    if ((INVALID_ROW == bridge->start_row) || (bridge->sizes[0] > 1)) {
+        begin += sample_weighted(rng, &bridge->reach[begin], bridge->sizes[0]);
+    }
+    uint32_t current = STATE_ROW(table, bridge->states[begin]);
+    rows[0] = current;
+
+    uint32_t capacity = 16;
+    double *weights = (double*)malloc(capacity * sizeof(double));
+    assert(NULL != weights);
+
+    for (uint32_t step = 1; step < bridge->length; step++) {
+        Row *row = &table->rows[ROW_INDEX(current)];
+
+        if (row->num_transitions > capacity) {
+            capacity = row->num_transitions;
+            weights = (double*)realloc(weights, capacity * sizeof(double));
+            assert(NULL != weights);
+        }
+
+        uint64_t step_end = bridge->offsets[step] + bridge->sizes[step];
+        for (uint32_t trans_index = 0; trans_index < row->num_transitions; trans_index++) {
+            uint32_t next = row->transitions[trans_index].next_row ^ (current & ROW_MIRRORED);
+            uint64_t index = find_state(bridge, step, STATE(table, next));
+            weights[trans_index] = index == step_end ? 0.0 : row->transitions[trans_index].count * bridge->reach[index];
+        }
+
+        uint32_t chosen = sample_weighted(rng, weights, row->num_transitions);
+        current = row->transitions[chosen].next_row ^ (current & ROW_MIRRORED);
+        rows[step] = current;
+    }
+
+    free(weights);
+}
@@ -0,0 +1,41 @@
+#ifndef DOWNGEN_BRIDGE
+#define DOWNGEN_BRIDGE
+
+#include <stdint.h>
+
+#include "rng.h"
+#include "table.h"
+
+
+// the walks through a table that start at one row and end at another,
+// length rows later. for each step, the rows that are on some such walk are
+// kept along with the chance of reaching the end row from them, so walks
+// can be sampled from exactly the table's distribution given both ends.
+typedef struct Bridge {
+    uint32_t length;
+    uint32_t start_row;
+    uint32_t end_row;
+
+    // the states of each step, sorted, from offsets[step] for sizes[step]
+    // entries, and the chance of reaching the end from each, scaled so the
+    // largest of each step is 1. a state is a row, and in a mirrored table
+    // each orientation of a row is its own state.
+    uint64_t *offsets;
+    uint32_t *sizes;
+    uint32_t *states;
+    double *reach;
+} Bridge;
+
+
+// start_row or end_row may be INVALID_ROW to leave that end free, starting
+// anywhere as walk_start() does or ending anywhere. in a mirrored table, a
+// row that is its own mirror image matches either of its states. returns
+// NULL if the end row can not be reached from the start in exactly
+// length - 1 steps. the caller holds the table's read lock.
+Bridge *bridge_create(Table *table, uint32_t start_row, uint32_t end_row, uint32_t length);
+void bridge_destroy(Bridge **bridge);
+
+// fill rows with length rows, from the start row to the end row
+void bridge_sample(Bridge *bridge, Table *table, Rng *rng, uint32_t *rows);
+
+#endif
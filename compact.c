@@ -0,0 +1,589 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+#include "bitmap.h"
+#include "table.h"
+
+#include "compact.h"
+
+
+// the rows that have the same cells in one block of the row
+typedef struct Bucket {
+    Bitmap key;
+    uint32_t start;
+    uint32_t size;
+} Bucket;
+
+// rows within d cells of each other agree on at least one of d + 1 blocks
+// of cells, so the rows close to a row are all in the buckets of its
+// blocks, and only those are compared
+typedef struct Block {
+    uint32_t shift;
+    Bitmap mask;
+    uint32_t num_buckets;
+    Bucket *buckets;
+    uint32_t *members;
+} Block;
+
+typedef struct BlockEntry {
+    Bitmap key;
+    uint32_t row_index;
+} BlockEntry;
+
+typedef struct RowOrder {
+    uint32_t count;
+    uint32_t row_index;
+} RowOrder;
+
+typedef struct MergedTransition {
+    uint32_t row_index;
+    uint32_t next_row;
+    uint32_t count;
+    bool kept;
+} MergedTransition;
+
+
+static uint32_t cell_distance(Bitmap a, Bitmap b, uint32_t bits_per_cell);
+static void build_block(Block *block, Table *table, uint32_t first_cell, uint32_t end_cell);
+static void claim_rows(Table *table, Block *blocks, uint32_t num_blocks, uint32_t max_distance,
+                       Bitmap bitmap, uint32_t row, uint32_t *mapping);
+static void merge_transitions(Table *table, Table *compacted, uint32_t const *mapping, uint32_t min_count);
+static void restore_paths(MergedTransition *merged, uint64_t const *starts, uint32_t num_rows);
+static void restore_tree(MergedTransition *merged, uint64_t const *starts, uint64_t const *edges,
+                         uint32_t const *component, uint32_t const *roots, uint32_t num_rows,
+                         uint32_t num_components);
+static uint32_t *find_components(MergedTransition const *merged, uint64_t const *starts, uint32_t num_rows,
+                                 uint32_t *num_components);
+static int compare_entries(void const *a, void const *b);
+static int compare_order(void const *a, void const *b);
+static int compare_transitions(void const *a, void const *b);
+
+
+Table *compact_table(Table *table, uint32_t max_distance, uint32_t min_count) {
+    uint32_t num_rows = table->num_rows;
+
+    // every row would be within the distance of every other
+    if (max_distance >= table->row_width) {
+        max_distance = table->row_width - 1;
+    }
+
+    // the most common rows are kept, and the rows near them merged into them
+    RowOrder *order = (RowOrder*)malloc(num_rows * sizeof(RowOrder));
+    assert(NULL != order);
+    for (uint32_t row_index = 0; row_index < num_rows; row_index++) {
+        order[row_index].count = table->rows[row_index].total_transitions;
+        order[row_index].row_index = row_index;
+    }
+    if (max_distance > 0) {
+        qsort(order, num_rows, sizeof(RowOrder), compare_order);
+    }
+
+    uint32_t num_blocks = max_distance + 1;
+    Block *blocks = (Block*)calloc(num_blocks, sizeof(Block));
+    assert(NULL != blocks);
+    if (max_distance > 0) {
+        for (uint32_t block_index = 0; block_index < num_blocks; block_index++) {
+            build_block(&blocks[block_index], table,
+                        block_index * table->row_width / num_blocks,
+                        (block_index + 1) * table->row_width / num_blocks);
+        }
+    }
+
+    // the row each row is merged into. in a mirrored table, the orientation
+    // bit means the row is close to that row's mirror image.
+    uint32_t *mapping = (uint32_t*)malloc(num_rows * sizeof(uint32_t));
+    assert(NULL != mapping);
+    memset(mapping, 0xFF, num_rows * sizeof(uint32_t));
+
+    Table *compacted = table_create_empty(table->row_width, table->bits_per_cell, table->mirror ? TABLE_MIRROR : 0);
+
+    for (uint32_t order_index = 0; order_index < num_rows; order_index++) {
+        uint32_t row_index = order[order_index].row_index;
+        if (INVALID_ROW != mapping[row_index]) {
+            continue;
+        }
+
+        Bitmap bitmap = table->rows[row_index].bitmap;
+        uint32_t kept = table_add_row(compacted, bitmap);
+        mapping[row_index] = kept;
+
+        if (max_distance > 0) {
+            claim_rows(table, blocks, num_blocks, max_distance, bitmap, kept, mapping);
+
+            Bitmap mirrored = bitmap_mirror(bitmap, table->row_width, table->bits_per_cell);
+            if (table->mirror && (mirrored != bitmap)) {
+                claim_rows(table, blocks, num_blocks, max_distance, mirrored, kept | ROW_MIRRORED, mapping);
+            }
+        }
+    }
+
+    merge_transitions(table, compacted, mapping, min_count);
+    compacted->version++;
+
+    for (uint32_t block_index = 0; block_index < num_blocks; block_index++) {
+        free(blocks[block_index].buckets);
+        free(blocks[block_index].members);
+    }
+    free(blocks);
+    free(mapping);
+    free(order);
+
+    return compacted;
+}
+
+// the number of cells that differ. cells of more than one bit are folded
+// down to their lowest bit first.
+static uint32_t cell_distance(Bitmap a, Bitmap b, uint32_t bits_per_cell) {
+    Bitmap diff = a ^ b;
+
+    if (bits_per_cell == 2) {
+        diff = (diff | (diff >> 1)) & 0x5555555555555555ULL;
+    } else if (bits_per_cell == 4) {
+        diff |= diff >> 1;
+        diff |= diff >> 2;
+        diff &= 0x1111111111111111ULL;
+    }
+
+    return __builtin_popcountll(diff);
+}
+
+// the leftmost cell is in the highest used bits, so the block's cells end
+// (width - end_cell) cells up from the bottom
+static void build_block(Block *block, Table *table, uint32_t first_cell, uint32_t end_cell) {
+    uint32_t num_rows = table->num_rows;
+
+    block->shift = (table->row_width - end_cell) * table->bits_per_cell;
+    block->mask = (1ULL << ((end_cell - first_cell) * table->bits_per_cell)) - 1;
+
+    BlockEntry *entries = (BlockEntry*)malloc(num_rows * sizeof(BlockEntry));
+    assert(NULL != entries);
+    for (uint32_t row_index = 0; row_index < num_rows; row_index++) {
+        entries[row_index].key = (table->rows[row_index].bitmap >> block->shift) & block->mask;
+        entries[row_index].row_index = row_index;
+    }
+    qsort(entries, num_rows, sizeof(BlockEntry), compare_entries);
+
+    block->buckets = (Bucket*)malloc(num_rows * sizeof(Bucket));
+    block->members = (uint32_t*)malloc(num_rows * sizeof(uint32_t));
+    assert(NULL != block->buckets);
+    assert(NULL != block->members);
+
+    block->num_buckets = 0;
+    for (uint32_t entry_index = 0; entry_index < num_rows; entry_index++) {
+        if ((entry_index == 0) || (entries[entry_index].key != entries[entry_index - 1].key)) {
+            Bucket *bucket = &block->buckets[block->num_buckets++];
+            bucket->key = entries[entry_index].key;
+            bucket->start = entry_index;
+            bucket->size = 0;
+        }
+        block->buckets[block->num_buckets - 1].size++;
+        block->members[entry_index] = entries[entry_index].row_index;
+    }
+
+    free(entries);
+}
+
+// map every row not yet merged that is within max_distance cells of bitmap
+// to row. merged rows are taken out of the buckets as they are passed, so
+// later searches skip them.
+static void claim_rows(Table *table, Block *blocks, uint32_t num_blocks, uint32_t max_distance,
+                       Bitmap bitmap, uint32_t row, uint32_t *mapping) {
+    for (uint32_t block_index = 0; block_index < num_blocks; block_index++) {
+        Block *block = &blocks[block_index];
+        Bitmap key = (bitmap >> block->shift) & block->mask;
+
+        uint32_t low = 0;
+        uint32_t high = block->num_buckets;
+        while (low < high) {
+            uint32_t mid = (low + high) / 2;
+            if (block->buckets[mid].key < key) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        if ((low == block->num_buckets) || (block->buckets[low].key != key)) {
+            continue;
+        }
+
+        Bucket *bucket = &block->buckets[low];
+        uint32_t *members = &block->members[bucket->start];
+        uint32_t num_left = 0;
+        for (uint32_t member_index = 0; member_index < bucket->size; member_index++) {
+            uint32_t member = members[member_index];
+            if (INVALID_ROW != mapping[member]) {
+                continue;
+            }
+
+            if (cell_distance(table->rows[member].bitmap, bitmap, table->bits_per_cell) <= max_distance) {
+                mapping[member] = row;
+            } else {
+                members[num_left++] = member;
+            }
+        }
+        bucket->size = num_left;
+    }
+}
+
+// move every transition over to the rows they were merged into, then sum
+// and prune them. a transition from a merged row in one orientation to a
+// merged row in another changes orientation by all three.
+static void merge_transitions(Table *table, Table *compacted, uint32_t const *mapping, uint32_t min_count) {
+    uint64_t num_merged = 0;
+    for (uint32_t row_index = 0; row_index < table->num_rows; row_index++) {
+        num_merged += table->rows[row_index].num_transitions;
+    }
+
+    MergedTransition *merged = (MergedTransition*)malloc((num_merged + 1) * sizeof(MergedTransition));
+    assert(NULL != merged);
+
+    uint64_t merged_index = 0;
+    for (uint32_t row_index = 0; row_index < table->num_rows; row_index++) {
+        Row *row = &table->rows[row_index];
+        uint32_t from = mapping[row_index];
+
+        for (uint32_t trans_index = 0; trans_index < row->num_transitions; trans_index++) {
+            uint32_t next_row = row->transitions[trans_index].next_row;
+            uint32_t to = mapping[ROW_INDEX(next_row)];
+
+            merged[merged_index].row_index = ROW_INDEX(from);
+            merged[merged_index].next_row = ROW_INDEX(to) | ((from ^ next_row ^ to) & ROW_MIRRORED);
+            merged[merged_index].count = row->transitions[trans_index].count;
+            merged_index++;
+        }
+    }
+    qsort(merged, num_merged, sizeof(MergedTransition), compare_transitions);
+
+    uint64_t num_summed = 0;
+    for (merged_index = 0; merged_index < num_merged; merged_index++) {
+        if ((num_summed > 0) &&
+            (merged[num_summed - 1].row_index == merged[merged_index].row_index) &&
+            (merged[num_summed - 1].next_row == merged[merged_index].next_row)) {
+            merged[num_summed - 1].count += merged[merged_index].count;
+        } else {
+            merged[num_summed++] = merged[merged_index];
+        }
+    }
+
+    // where each row's transitions start, with one past the end for the last
+    uint32_t num_rows = compacted->num_rows;
+    uint64_t *starts = (uint64_t*)calloc(num_rows + 1, sizeof(uint64_t));
+    assert(NULL != starts);
+    for (merged_index = 0; merged_index < num_summed; merged_index++) {
+        starts[merged[merged_index].row_index + 1]++;
+    }
+    for (uint32_t row_index = 0; row_index < num_rows; row_index++) {
+        starts[row_index + 1] += starts[row_index];
+    }
+
+    for (merged_index = 0; merged_index < num_summed; merged_index++) {
+        merged[merged_index].kept = merged[merged_index].count >= min_count;
+    }
+    restore_paths(merged, starts, num_rows);
+
+    // a row can go to every row, in both orientations
+    Transition *kept = (Transition*)malloc((2 * (uint64_t)num_rows + 1) * sizeof(Transition));
+    assert(NULL != kept);
+
+    for (uint32_t row_index = 0; row_index < num_rows; row_index++) {
+        uint32_t num_kept = 0;
+        for (uint64_t index = starts[row_index]; index < starts[row_index + 1]; index++) {
+            if (merged[index].kept) {
+                kept[num_kept].next_row = merged[index].next_row;
+                kept[num_kept].count = merged[index].count;
+                num_kept++;
+            }
+        }
+
+        if (num_kept > 0) {
+            table_set_transitions(compacted, row_index, num_kept, kept);
+        }
+    }
+
+    free(kept);
+    free(starts);
+    free(merged);
+}
+
+// pruning can leave a group of rows whose kept transitions never lead out
+// of the group, trapping the walk there. so within each group of rows that
+// all reach each other before pruning, paths out from and back to its most
+// common row are restored, and each group that had a way out keeps one.
+// the pruned chain then has the same closed groups as the whole one.
+static void restore_paths(MergedTransition *merged, uint64_t const *starts, uint32_t num_rows) {
+    uint64_t num_edges = starts[num_rows];
+
+    uint32_t num_components = 0;
+    uint32_t *component = find_components(merged, starts, num_rows, &num_components);
+
+    // the transitions into each row, for paths back to the root
+    uint64_t *in_starts = (uint64_t*)calloc(num_rows + 1, sizeof(uint64_t));
+    uint64_t *in_edges = (uint64_t*)malloc((num_edges + 1) * sizeof(uint64_t));
+    assert((NULL != in_starts) && (NULL != in_edges));
+    for (uint64_t index = 0; index < num_edges; index++) {
+        in_starts[ROW_INDEX(merged[index].next_row) + 1]++;
+    }
+    for (uint32_t row_index = 0; row_index < num_rows; row_index++) {
+        in_starts[row_index + 1] += in_starts[row_index];
+    }
+    uint64_t *fill = (uint64_t*)malloc((num_rows + 1) * sizeof(uint64_t));
+    assert(NULL != fill);
+    memcpy(fill, in_starts, (num_rows + 1) * sizeof(uint64_t));
+    for (uint64_t index = 0; index < num_edges; index++) {
+        in_edges[fill[ROW_INDEX(merged[index].next_row)]++] = index;
+    }
+    free(fill);
+
+    // the root of each group is its most common row
+    uint64_t *totals = (uint64_t*)calloc(num_rows, sizeof(uint64_t));
+    uint32_t *roots = (uint32_t*)malloc(num_components * sizeof(uint32_t));
+    assert((NULL != totals) && (NULL != roots));
+    memset(roots, 0xFF, num_components * sizeof(uint32_t));
+    for (uint32_t row_index = 0; row_index < num_rows; row_index++) {
+        for (uint64_t index = starts[row_index]; index < starts[row_index + 1]; index++) {
+            totals[row_index] += merged[index].count;
+        }
+
+        uint32_t *root = &roots[component[row_index]];
+        if ((INVALID_ROW == *root) || (totals[row_index] > totals[*root])) {
+            *root = row_index;
+        }
+    }
+
+    restore_tree(merged, starts, NULL, component, roots, num_rows, num_components);
+    restore_tree(merged, in_starts, in_edges, component, roots, num_rows, num_components);
+
+    // the strongest way out of each group, unless one is kept already
+    bool *leaves = (bool*)calloc(num_components, sizeof(bool));
+    uint64_t *exits = (uint64_t*)malloc(num_components * sizeof(uint64_t));
+    assert((NULL != leaves) && (NULL != exits));
+    for (uint32_t component_index = 0; component_index < num_components; component_index++) {
+        exits[component_index] = num_edges;
+    }
+    for (uint32_t row_index = 0; row_index < num_rows; row_index++) {
+        uint32_t from = component[row_index];
+        for (uint64_t index = starts[row_index]; index < starts[row_index + 1]; index++) {
+            if (component[ROW_INDEX(merged[index].next_row)] == from) {
+                continue;
+            }
+
+            leaves[from] = leaves[from] || merged[index].kept;
+            if ((exits[from] == num_edges) || (merged[index].count > merged[exits[from]].count)) {
+                exits[from] = index;
+            }
+        }
+    }
+    for (uint32_t component_index = 0; component_index < num_components; component_index++) {
+        if (!leaves[component_index] && (exits[component_index] != num_edges)) {
+            merged[exits[component_index]].kept = true;
+        }
+    }
+
+    // a row that only goes to itself keeps doing so
+    for (uint32_t row_index = 0; row_index < num_rows; row_index++) {
+        uint64_t strongest = starts[row_index];
+        bool any_kept = false;
+        for (uint64_t index = starts[row_index]; index < starts[row_index + 1]; index++) {
+            any_kept = any_kept || merged[index].kept;
+            if (merged[index].count > merged[strongest].count) {
+                strongest = index;
+            }
+        }
+        if (!any_kept && (strongest < starts[row_index + 1])) {
+            merged[strongest].kept = true;
+        }
+    }
+
+    free(leaves);
+    free(exits);
+    free(totals);
+    free(roots);
+    free(in_starts);
+    free(in_edges);
+    free(component);
+}
+
+// find paths from every group's root to the rest of its group (or, given
+// the transitions into each row, from the rest of the group to the root)
+// using as few dropped transitions as possible, and keep the ones used.
+// this is a breadth first search where kept transitions cost nothing, so
+// they go on the front of the queue and dropped ones on the back.
+static void restore_tree(MergedTransition *merged, uint64_t const *starts, uint64_t const *edges,
+                         uint32_t const *component, uint32_t const *roots, uint32_t num_rows,
+                         uint32_t num_components) {
+    uint64_t num_edges = starts[num_rows];
+
+    uint32_t *distance = (uint32_t*)malloc(num_rows * sizeof(uint32_t));
+    uint64_t *parent = (uint64_t*)malloc(num_rows * sizeof(uint64_t));
+    assert((NULL != distance) && (NULL != parent));
+    memset(distance, 0xFF, num_rows * sizeof(uint32_t));
+
+    // every transition is relaxed at most once, so this never overflows
+    uint64_t capacity = num_edges + num_rows + 1;
+    uint32_t *queue = (uint32_t*)malloc(capacity * sizeof(uint32_t));
+    assert(NULL != queue);
+    uint64_t head = 0;
+    uint64_t tail = 0;
+
+    for (uint32_t component_index = 0; component_index < num_components; component_index++) {
+        distance[roots[component_index]] = 0;
+        parent[roots[component_index]] = num_edges;
+        queue[tail++] = roots[component_index];
+    }
+
+    while (head != tail) {
+        uint32_t row_index = queue[head];
+        head = (head + 1) % capacity;
+
+        for (uint64_t position = starts[row_index]; position < starts[row_index + 1]; position++) {
+            uint64_t index = NULL != edges ? edges[position] : position;
+            uint32_t other = NULL != edges ? merged[index].row_index : ROW_INDEX(merged[index].next_row);
+            if (component[other] != component[row_index]) {
+                continue;
+            }
+
+            uint32_t cost = merged[index].kept ? 0 : 1;
+            if (distance[row_index] + cost >= distance[other]) {
+                continue;
+            }
+
+            distance[other] = distance[row_index] + cost;
+            parent[other] = index;
+            if (cost == 0) {
+                head = (head + capacity - 1) % capacity;
+                queue[head] = other;
+            } else {
+                queue[tail] = other;
+                tail = (tail + 1) % capacity;
+            }
+        }
+    }
+
+    for (uint32_t row_index = 0; row_index < num_rows; row_index++) {
+        if (parent[row_index] != num_edges) {
+            merged[parent[row_index]].kept = true;
+        }
+    }
+
+    free(queue);
+    free(parent);
+    free(distance);
+}
+
+// the strongly connected components of every transition, kept or not, with
+// tarjan's algorithm run on an explicit stack, as in analysis.c
+static uint32_t *find_components(MergedTransition const *merged, uint64_t const *starts, uint32_t num_rows,
+                                 uint32_t *num_components) {
+    uint32_t *component = (uint32_t*)malloc(num_rows * sizeof(uint32_t));
+    uint32_t *order = (uint32_t*)malloc(num_rows * sizeof(uint32_t));
+    uint32_t *low = (uint32_t*)malloc(num_rows * sizeof(uint32_t));
+    uint64_t *next_edge = (uint64_t*)malloc(num_rows * sizeof(uint64_t));
+    uint32_t *stack = (uint32_t*)malloc(num_rows * sizeof(uint32_t));
+    uint32_t *calls = (uint32_t*)malloc(num_rows * sizeof(uint32_t));
+    bool *on_stack = (bool*)calloc(num_rows, sizeof(bool));
+    assert((NULL != component) && (NULL != order) && (NULL != low) && (NULL != next_edge));
+    assert((NULL != stack) && (NULL != calls) && (NULL != on_stack));
+
+    for (uint32_t row_index = 0; row_index < num_rows; row_index++) {
+        order[row_index] = INVALID_ROW;
+        next_edge[row_index] = starts[row_index];
+    }
+
+    uint32_t num_visited = 0;
+    uint32_t stack_size = 0;
+    *num_components = 0;
+
+    for (uint32_t root = 0; root < num_rows; root++) {
+        if (order[root] != INVALID_ROW) {
+            continue;
+        }
+
+        uint32_t num_calls = 0;
+        calls[num_calls++] = root;
+        order[root] = low[root] = num_visited++;
+        stack[stack_size++] = root;
+        on_stack[root] = true;
+
+        while (num_calls > 0) {
+            uint32_t row_index = calls[num_calls - 1];
+
+            if (next_edge[row_index] < starts[row_index + 1]) {
+                MergedTransition const *edge = &merged[next_edge[row_index]];
+                next_edge[row_index]++;
+
+                uint32_t next_row = ROW_INDEX(edge->next_row);
+                if (order[next_row] == INVALID_ROW) {
+                    order[next_row] = low[next_row] = num_visited++;
+                    stack[stack_size++] = next_row;
+                    on_stack[next_row] = true;
+                    calls[num_calls++] = next_row;
+                } else if (on_stack[next_row] && (order[next_row] < low[row_index])) {
+                    low[row_index] = order[next_row];
+                }
+                continue;
+            }
+
+            num_calls--;
+            if (num_calls > 0) {
+                uint32_t parent = calls[num_calls - 1];
+                if (low[row_index] < low[parent]) {
+                    low[parent] = low[row_index];
+                }
+            }
+
+            if (low[row_index] == order[row_index]) {
+                uint32_t member = INVALID_ROW;
+                do {
+                    member = stack[--stack_size];
+                    on_stack[member] = false;
+                    component[member] = *num_components;
+                } while (member != row_index);
+                (*num_components)++;
+            }
+        }
+    }
+
+    free(order);
+    free(low);
+    free(next_edge);
+    free(stack);
+    free(calls);
+    free(on_stack);
+
+    return component;
+}
+
+static int compare_entries(void const *a, void const *b) {
+    BlockEntry const *first = (BlockEntry const*)a;
+    BlockEntry const *second = (BlockEntry const*)b;
+
+    if (first->key != second->key) {
+        return first->key < second->key ? -1 : 1;
+    }
+    return first->row_index < second->row_index ? -1 : (first->row_index > second->row_index);
+}
+
+// most common first, then by index so the order does not depend on qsort
+static int compare_order(void const *a, void const *b) {
+    RowOrder const *first = (RowOrder const*)a;
+    RowOrder const *second = (RowOrder const*)b;
+
+    if (first->count != second->count) {
+        return first->count > second->count ? -1 : 1;
+    }
+    return first->row_index < second->row_index ? -1 : (first->row_index > second->row_index);
+}
+
+static int compare_transitions(void const *a, void const *b) {
+    MergedTransition const *first = (MergedTransition const*)a;
+    MergedTransition const *second = (MergedTransition const*)b;
+
+    if (first->row_index != second->row_index) {
+        return first->row_index < second->row_index ? -1 : 1;
+    }
+    return first->next_row < second->next_row ? -1 : (first->next_row > second->next_row);
+}
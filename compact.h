@@ -0,0 +1,17 @@
+#ifndef DOWNGEN_COMPACT
+#define DOWNGEN_COMPACT
+
+#include <stdint.h>
+
+#include "table.h"
+
+
+// build a smaller copy of a table. rows within max_distance cells of each
+// other are merged into the most common of them, summing their transitions,
+// then transitions seen fewer than min_count times are dropped. enough of
+// those are kept that no row becomes a dead end, and no group of rows
+// becomes a trap the walk can not leave. the caller holds the table's read
+// lock.
+Table *compact_table(Table *table, uint32_t max_distance, uint32_t min_count);
+
+#endif
@@ -14,6 +14,7 @@
 
 /* helper to write a little-endian 16-bit number portably */
 #define write_num(fd, n) write((fd), (uint8_t []) {(n) & 0xFF, (n) >> 8}, 2)
+#define put_num(buf, n) put_bytes((buf), (uint8_t []) {(n) & 0xFF, (n) >> 8}, 2)
 
 static uint8_t vga[0x30] = {
     0x00, 0x00, 0x00,
@@ -72,26 +73,78 @@ del_trie(Node *root, int degree)
 
 static void put_loop(ge_GIF *gif, uint16_t loop);
 
+/* Append bytes to a growable buffer. */
+static void
+put_bytes(ge_Buffer *buf, const void *data, size_t size)
+{
+    if (buf->size + size > buf->capacity) {
+        size_t capacity = buf->capacity ? buf->capacity : 0x1000;
+        while (capacity < buf->size + size)
+            capacity *= 2;
+        buf->data = realloc(buf->data, capacity);
+        if (!buf->data)
+            abort();
+        buf->capacity = capacity;
+    }
+    memcpy(&buf->data[buf->size], data, size);
+    buf->size += size;
+}
+
 ge_GIF *
 ge_new_gif(
     const char *fname, uint16_t width, uint16_t height,
     uint8_t *palette, int depth, int loop
 )
 {
-    int i, r, g, b, v;
-    ge_GIF *gif = calloc(1, sizeof(*gif) + 2*width*height);
+    ge_GIF *gif;
+    int fd = creat(fname, 0666);
+    if (fd == -1)
+        return NULL;
+#ifdef _WIN32
+    setmode(fd, O_BINARY);
+#endif
+    gif = ge_new_gif_fd(fd, width, height, palette, depth, loop);
+    if (!gif)
+        close(fd);
+    return gif;
+}
+
+/* Same as ge_new_gif(), but write to an already open descriptor, such as
+ * a pipe or socket. The GIF takes ownership of fd and closes it in
+ * ge_close_gif(). */
+ge_GIF *
+ge_new_gif_fd(
+    int fd, uint16_t width, uint16_t height,
+    uint8_t *palette, int depth, int loop
+)
+{
+    int bits = 2;
+    while (bits < depth)
+        bits *= 2;
+    return ge_new_gif_packed(fd, width, height, palette, depth, loop, bits);
+}
+
+ge_GIF *
+ge_new_gif_packed(
+    int fd, uint16_t width, uint16_t height,
+    uint8_t *palette, int depth, int loop, int bits
+)
+{
+    int i, r, g, b, v, stride;
+    ge_GIF *gif;
+    if (bits != 1 && bits != 2 && bits != 4 && bits != 8)
+        return NULL;
+    stride = (width * bits + 63) / 64;
+    gif = calloc(1, sizeof(*gif) + 2 * stride * height * sizeof(uint64_t));
     if (!gif)
-        goto no_gif;
+        return NULL;
     gif->w = width; gif->h = height;
     gif->depth = depth > 1 ? depth : 2;
-    gif->frame = (uint8_t *) &gif[1];
-    gif->back = &gif->frame[width*height];
-    gif->fd = creat(fname, 0666);
-    if (gif->fd == -1)
-        goto no_fd;
-#ifdef _WIN32
-    setmode(gif->fd, O_BINARY);
-#endif
+    gif->bits = bits;
+    gif->stride = stride;
+    gif->frame = (uint64_t *) &gif[1];
+    gif->back = &gif->frame[stride*height];
+    gif->fd = fd;
     write(gif->fd, "GIF89a", 6);
     write_num(gif->fd, width);
     write_num(gif->fd, height);
@@ -121,10 +174,6 @@ done_gct:
     if (loop >= 0 && loop <= 0xFFFF)
         put_loop(gif, (uint16_t) loop);
     return gif;
-no_fd:
-    free(gif);
-no_gif:
-    return NULL;
 }
 
 static void
@@ -151,8 +200,8 @@ put_key(ge_GIF *gif, uint16_t key, int key_size)
     while (bits_to_write >= 8) {
         gif->buffer[byte_offset++] = gif->partial & 0xFF;
         if (byte_offset == 0xFF) {
-            write(gif->fd, "\xFF", 1);
-            write(gif->fd, gif->buffer, 0xFF);
+            put_bytes(&gif->image, "\xFF", 1);
+            put_bytes(&gif->image, gif->buffer, 0xFF);
             byte_offset = 0;
         }
         gif->partial >>= 8;
@@ -168,71 +217,134 @@ end_key(ge_GIF *gif)
     byte_offset = gif->offset / 8;
     if (gif->offset % 8)
         gif->buffer[byte_offset++] = gif->partial & 0xFF;
-    write(gif->fd, (uint8_t []) {byte_offset}, 1);
-    write(gif->fd, gif->buffer, byte_offset);
-    write(gif->fd, "\0", 1);
+    put_bytes(&gif->image, (uint8_t []) {byte_offset}, 1);
+    put_bytes(&gif->image, gif->buffer, byte_offset);
+    put_bytes(&gif->image, "\0", 1);
     gif->offset = gif->partial = 0;
 }
 
+void
+ge_set_clear_policy(ge_GIF *gif, int policy)
+{
+    gif->clear_policy = policy;
+}
+
+void
+ge_set_pixel(ge_GIF *gif, uint16_t x, uint16_t y, uint8_t color)
+{
+    uint64_t *word = &gif->frame[y*gif->stride + x*gif->bits/64];
+    int shift = x*gif->bits % 64;
+    *word &= ~(((1ULL << gif->bits) - 1) << shift);
+    *word |= (uint64_t) color << shift;
+}
+
+/* While a full dictionary is kept, the codes put for each window of this
+ * many pixels are counted. A new dictionary is started once a window
+ * compresses worse than the dictionary did while it was being built, which
+ * is about what a new one would do. */
+#define CHECK_PIXELS 0x2000
+
 static void
 put_image(ge_GIF *gif, uint16_t w, uint16_t h, uint16_t x, uint16_t y)
 {
     int nkeys, key_size, i, j;
+    long window_pixels = 0, window_keys = 0, built_pixels = 0, built_keys = 0;
     Node *node, *child, *root;
     int degree = 1 << gif->depth;
+    int bits = gif->bits;
+    uint64_t mask = ((1ULL << bits) - 1) & (degree - 1);
 
-    write(gif->fd, ",", 1);
-    write_num(gif->fd, x);
-    write_num(gif->fd, y);
-    write_num(gif->fd, w);
-    write_num(gif->fd, h);
-    write(gif->fd, (uint8_t []) {0x00, gif->depth}, 2);
+    gif->image.size = 0;
+    put_bytes(&gif->image, ",", 1);
+    put_num(&gif->image, x);
+    put_num(&gif->image, y);
+    put_num(&gif->image, w);
+    put_num(&gif->image, h);
+    put_bytes(&gif->image, (uint8_t []) {0x00, gif->depth}, 2);
     root = node = new_trie(degree, &nkeys);
     key_size = gif->depth + 1;
     put_key(gif, degree, key_size); /* clear code */
     for (i = y; i < y+h; i++) {
+        /* shift pixels out of the line a word at a time */
+        const uint64_t *word = &gif->frame[i*gif->stride + x*bits/64];
+        uint64_t pixels = *word++ >> (x*bits % 64);
+        int left = (64 - x*bits % 64) / bits;
         for (j = x; j < x+w; j++) {
-            uint8_t pixel = gif->frame[i*gif->w+j] & (degree - 1);
+            uint8_t pixel;
+            if (!left) {
+                pixels = *word++;
+                left = 64 / bits;
+            }
+            pixel = pixels & mask;
+            pixels >>= bits;
+            left--;
+            window_pixels++;
             child = node->children[pixel];
             if (child) {
                 node = child;
             } else {
                 put_key(gif, node->key, key_size);
+                window_keys++;
                 if (nkeys < 0x1000) {
                     if (nkeys == (1 << key_size))
                         key_size++;
                     node->children[pixel] = new_node(nkeys++, degree);
-                } else {
+                } else if (gif->clear_policy == GE_CLEAR_RATIO && !built_keys) {
+                    /* the dictionary just filled up; keep it for now */
+                    built_pixels = window_pixels;
+                    built_keys = window_keys;
+                    window_pixels = window_keys = 0;
+                } else if (gif->clear_policy == GE_CLEAR_FULL ||
+                           (window_pixels >= CHECK_PIXELS &&
+                            window_keys * built_pixels > built_keys * window_pixels)) {
                     put_key(gif, degree, key_size); /* clear code */
                     del_trie(root, degree);
                     root = node = new_trie(degree, &nkeys);
                     key_size = gif->depth + 1;
+                    window_pixels = window_keys = built_pixels = built_keys = 0;
+                } else if (window_pixels >= CHECK_PIXELS) {
+                    window_pixels = window_keys = 0;
                 }
                 node = root->children[pixel];
             }
         }
     }
     put_key(gif, node->key, key_size);
+    /* decoders widen their codes after the last one, as for any other */
+    if (nkeys < 0x1000 && nkeys == (1 << key_size))
+        key_size++;
     put_key(gif, degree + 1, key_size); /* stop code */
     end_key(gif);
     del_trie(root, degree);
 }
 
-static int
-get_bbox(ge_GIF *gif, uint16_t *w, uint16_t *h, uint16_t *x, uint16_t *y)
+int
+ge_get_bbox(ge_GIF *gif, uint16_t *w, uint16_t *h, uint16_t *x, uint16_t *y)
 {
     int i, j, k;
     int left, right, top, bottom;
+    int per_word = 64 / gif->bits;
+    if (gif->nframes == 0) {
+        /* the first frame is always drawn in full */
+        *w = gif->w;
+        *h = gif->h;
+        *x = *y = 0;
+        return 1;
+    }
+    /* compare whole words; the padding at the end of a line is always 0 */
     left = gif->w; right = 0;
     top = gif->h; bottom = 0;
     k = 0;
     for (i = 0; i < gif->h; i++) {
-        for (j = 0; j < gif->w; j++, k++) {
-            if (gif->frame[k] != gif->back[k]) {
-                if (j < left)   left    = j;
-                if (j > right)  right   = j;
-                if (i < top)    top     = i;
-                if (i > bottom) bottom  = i;
+        for (j = 0; j < gif->stride; j++, k++) {
+            uint64_t diff = gif->frame[k] ^ gif->back[k];
+            if (diff) {
+                int first = j*per_word + __builtin_ctzll(diff) / gif->bits;
+                int last = j*per_word + (63 - __builtin_clzll(diff)) / gif->bits;
+                if (first < left)   left    = first;
+                if (last > right)   right   = last;
+                if (i < top)        top     = i;
+                if (i > bottom)     bottom  = i;
             }
         }
     }
@@ -254,34 +366,72 @@ set_delay(ge_GIF *gif, uint16_t d)
     write(gif->fd, "\0\0", 2);
 }
 
+static void
+flush_pending(ge_GIF *gif)
+{
+    if (!gif->has_pending)
+        return;
+    if (gif->pending_delay)
+        set_delay(gif, gif->pending_delay);
+    write(gif->fd, gif->pending.data, gif->pending.size);
+    gif->has_pending = 0;
+}
+
+const uint8_t *
+ge_encode_image(
+    ge_GIF *gif, uint16_t w, uint16_t h, uint16_t x, uint16_t y,
+    size_t *size
+)
+{
+    put_image(gif, w, h, x, y);
+    *size = gif->image.size;
+    return gif->image.data;
+}
+
 void
-ge_add_frame(ge_GIF *gif, uint16_t delay)
+ge_add_image(ge_GIF *gif, uint16_t delay, const uint8_t *image, size_t size)
 {
-    uint16_t w, h, x, y;
-    uint8_t *tmp;
+    uint64_t *tmp;
 
-    if (delay)
-        set_delay(gif, delay);
-    if (gif->nframes == 0) {
-        w = gif->w;
-        h = gif->h;
-        x = y = 0;
-    } else if (!get_bbox(gif, &w, &h, &x, &y)) {
-        /* image's not changed; save one pixel just to add delay */
-        w = h = 1;
-        x = y = 0;
+    if (!image && gif->has_pending && gif->pending_delay + delay <= 0xFFFF) {
+        /* image's not changed; show the last one for longer */
+        gif->pending_delay += delay;
+    } else {
+        if (!image) {
+            /* the delay is full; save one pixel just to add delay */
+            image = ge_encode_image(gif, 1, 1, 0, 0, &size);
+        }
+        flush_pending(gif);
+        gif->pending.size = 0;
+        put_bytes(&gif->pending, image, size);
+        gif->pending_delay = delay;
+        gif->has_pending = 1;
     }
-    put_image(gif, w, h, x, y);
     gif->nframes++;
     tmp = gif->back;
     gif->back = gif->frame;
     gif->frame = tmp;
 }
 
+void
+ge_add_frame(ge_GIF *gif, uint16_t delay)
+{
+    uint16_t w, h, x, y;
+    const uint8_t *image = NULL;
+    size_t size = 0;
+
+    if (ge_get_bbox(gif, &w, &h, &x, &y))
+        image = ge_encode_image(gif, w, h, x, y, &size);
+    ge_add_image(gif, delay, image, size);
+}
+
 void
 ge_close_gif(ge_GIF* gif)
 {
+    flush_pending(gif);
     write(gif->fd, ";", 1);
     close(gif->fd);
+    free(gif->image.data);
+    free(gif->pending.data);
     free(gif);
 }
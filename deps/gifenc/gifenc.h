@@ -2,6 +2,22 @@
 #define GIFENC_H
 
 #include <stdint.h>
+#include <stddef.h>
+
+/* What to do once the LZW dictionary of an image holds all 4096 codes.
+ * GE_CLEAR_FULL starts a new dictionary straight away. GE_CLEAR_RATIO keeps
+ * encoding with the full one, and only starts again once it compresses
+ * worse than it did while it was filling up, which suits images that
+ * repeat themselves. */
+enum {
+    GE_CLEAR_FULL,
+    GE_CLEAR_RATIO
+};
+
+typedef struct ge_Buffer {
+    uint8_t *data;
+    size_t size, capacity;
+} ge_Buffer;
 
 typedef struct ge_GIF {
     uint16_t w, h;
@@ -9,16 +25,57 @@ typedef struct ge_GIF {
     int fd;
     int offset;
     int nframes;
-    uint8_t *frame, *back;
+    /* pixels are packed bits to a word, the first pixel of a line in the
+     * lowest bits of its first word, and each line starts a new word */
+    int bits;
+    int stride;
+    uint64_t *frame, *back;
+    int clear_policy;
     uint32_t partial;
     uint8_t buffer[0xFF];
+    /* the image block being encoded */
+    ge_Buffer image;
+    /* the last frame added, held back until it is known how long it shows */
+    ge_Buffer pending;
+    uint32_t pending_delay;
+    int has_pending;
 } ge_GIF;
 
 ge_GIF *ge_new_gif(
     const char *fname, uint16_t width, uint16_t height,
     uint8_t *palette, int depth, int loop
 );
+ge_GIF *ge_new_gif_fd(
+    int fd, uint16_t width, uint16_t height,
+    uint8_t *palette, int depth, int loop
+);
+/* Same as ge_new_gif_fd(), with frames packed at 1, 2, 4 or 8 bits per
+ * pixel. Fewer bits than depth can be used when only the first colors of
+ * the palette are drawn. */
+ge_GIF *ge_new_gif_packed(
+    int fd, uint16_t width, uint16_t height,
+    uint8_t *palette, int depth, int loop, int bits
+);
+/* Choose when images are encoded with a new LZW dictionary, from the
+ * GE_CLEAR_ values above. The default is GE_CLEAR_FULL. */
+void ge_set_clear_policy(ge_GIF *gif, int policy);
+/* Set pixel x of line y of the frame. */
+void ge_set_pixel(ge_GIF *gif, uint16_t x, uint16_t y, uint8_t color);
 void ge_add_frame(ge_GIF *gif, uint16_t delay);
+
+/* The steps of ge_add_frame(), for callers that reuse encoded images.
+ * ge_get_bbox() finds the part of the frame that changed since the last
+ * one, returning 0 if nothing did. ge_encode_image() encodes that part of
+ * the frame, returning an image block that stays valid until the next
+ * call. ge_add_image() adds a frame shown as the given image block, or,
+ * when image is NULL, a frame that is unchanged, which only adds its delay
+ * to the frame before. */
+int ge_get_bbox(ge_GIF *gif, uint16_t *w, uint16_t *h, uint16_t *x, uint16_t *y);
+const uint8_t *ge_encode_image(
+    ge_GIF *gif, uint16_t w, uint16_t h, uint16_t x, uint16_t y,
+    size_t *size
+);
+void ge_add_image(ge_GIF *gif, uint16_t delay, const uint8_t *image, size_t size);
 void ge_close_gif(ge_GIF* gif);
 
 #endif /* GIFENC_H */
@@ -0,0 +1,514 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <ctype.h>
+
+#include "bitmap.h"
+#include "table.h"
+
+#include "external.h"
+
+
+#define CHUNK_SIZE (1 << 20)
+#define MIN_PAIRS 1024
+
+// the most runs merged at once. this many runs of one size are merged into
+// one run of the next size as soon as they are written, so a small memory
+// budget on a large level does not run out of open files.
+#define MERGE_FANIN 64
+
+
+// one transition, from one row to the next. flip is ROW_MIRRORED when the
+// orientation changes between the rows of a mirrored table.
+typedef struct Pair {
+    Bitmap from;
+    Bitmap to;
+    uint32_t flip;
+    uint32_t count;
+} Pair;
+
+typedef struct Spill {
+    uint32_t width;
+    uint32_t bits_per_cell;
+    bool mirror;
+    BitmapKernels kernels;
+
+    Pair *pairs;
+    uint64_t num_pairs;
+    uint64_t capacity;
+
+    // the runs not yet merged, largest first, with the number of times
+    // each has been merged
+    FILE **runs;
+    uint32_t *run_levels;
+    uint32_t num_runs;
+    uint32_t runs_written;
+} Spill;
+
+typedef struct Merge {
+    FILE *run;
+    Pair pair;
+} Merge;
+
+
+static bool scan_level(FILE *file, uint32_t *width, uint32_t *bits_per_cell, uint64_t *num_rows);
+static bool spill_level(FILE *file, Spill *spill);
+static void spill_row(Spill *spill, Bitmap map, uint32_t orientation, Bitmap prev, uint32_t prev_orientation);
+static void add_pair(Spill *spill, Bitmap from, Bitmap to, uint32_t flip);
+static void write_run(Spill *spill);
+static void collapse_runs(Spill *spill);
+static uint64_t merge_runs(FILE **runs, uint32_t num_runs, FILE *merged, Bitmap **vocabulary);
+static bool write_model(FILE *merged, Bitmap *vocabulary, uint64_t num_rows, Spill *spill, FILE *model);
+static int compare_pairs(void const *left, void const *right);
+static void sift_down(Merge *heap, uint32_t size, uint32_t index);
+
+
+bool external_train(char const *level_name, char const *model_name, uint32_t flags, uint64_t memory_budget) {
+    FILE *file = fopen(level_name, "rb");
+    if (NULL == file) {
+        fprintf(stderr, "Could not open '%s'!\n", level_name);
+        return false;
+    }
+
+    Spill spill;
+    memset(&spill, 0, sizeof(spill));
+
+    uint64_t level_height = 0;
+    if (!scan_level(file, &spill.width, &spill.bits_per_cell, &level_height)) {
+        fclose(file);
+        return false;
+    }
+    if ((spill.width * spill.bits_per_cell) > 64) {
+        fprintf(stderr, "Level width must be at most %d for %d tile types (was %d)!\n",
+                64 / spill.bits_per_cell, 1 << spill.bits_per_cell, spill.width);
+        fclose(file);
+        return false;
+    }
+
+    spill.mirror = (flags & TABLE_MIRROR) != 0;
+    spill.kernels = bitmap_kernels(spill.width, spill.bits_per_cell);
+    spill.capacity = memory_budget / sizeof(Pair);
+    if (spill.capacity < MIN_PAIRS) {
+        spill.capacity = MIN_PAIRS;
+    }
+    spill.pairs = (Pair*)malloc(spill.capacity * sizeof(Pair));
+    assert(NULL != spill.pairs);
+
+    rewind(file);
+    bool ok = spill_level(file, &spill);
+    fclose(file);
+
+    free(spill.pairs);
+    spill.pairs = NULL;
+
+    FILE *merged = tmpfile();
+    FILE *model = fopen(model_name, "wb");
+    if (!ok || (NULL == merged) || (NULL == model)) {
+        fprintf(stderr, "Could not write '%s'!\n", model_name);
+        ok = false;
+    }
+
+    if (ok) {
+        Bitmap *vocabulary = NULL;
+        uint64_t num_rows = merge_runs(spill.runs, spill.num_runs, merged, &vocabulary);
+
+        fprintf(stderr, "Trained on %llu rows in %d runs, giving %llu unique rows\n",
+                (unsigned long long)level_height, spill.runs_written, (unsigned long long)num_rows);
+
+        rewind(merged);
+        ok = write_model(merged, vocabulary, num_rows, &spill, model);
+        free(vocabulary);
+    }
+
+    for (uint32_t run_index = 0; run_index < spill.num_runs; run_index++) {
+        fclose(spill.runs[run_index]);
+    }
+    free(spill.runs);
+    free(spill.run_levels);
+
+    if (NULL != merged) {
+        fclose(merged);
+    }
+    if (NULL != model) {
+        ok = (0 == fclose(model)) && ok;
+    }
+
+    return ok;
+}
+
+// find the width, tile types and size of the level, the same way
+// parse_level() reads them, without keeping any of it
+static bool scan_level(FILE *file, uint32_t *width, uint32_t *bits_per_cell, uint64_t *num_rows) {
+    char *chunk = (char*)malloc(CHUNK_SIZE);
+    assert(NULL != chunk);
+
+    uint64_t num_cells = 0;
+    int max_symbol = 0;
+    bool ok = true;
+    *width = 0;
+
+    size_t amount = 0;
+    while (ok && ((amount = fread(chunk, 1, CHUNK_SIZE, file)) > 0)) {
+        for (size_t index = 0; index < amount; index++) {
+            if (isspace(chunk[index])) {
+                if ((*width == 0) && (num_cells > 0)) {
+                    *width = num_cells;
+                }
+                continue;
+            }
+
+            int symbol = bitmap_symbol(chunk[index]);
+            if (symbol < 0) {
+                fprintf(stderr, "Character '%c' is invalid in a level file!\n", chunk[index]);
+                ok = false;
+                break;
+            }
+            if (symbol > max_symbol) {
+                max_symbol = symbol;
+            }
+            num_cells++;
+        }
+    }
+
+    free(chunk);
+
+    if (*width == 0) {
+        *width = num_cells;
+    }
+    if (ok && ((*width == 0) || ((num_cells % *width) != 0))) {
+        fprintf(stderr, "Every line of a level must have the same number of characters!\n");
+        ok = false;
+    }
+
+    *bits_per_cell = max_symbol < 2 ? 1 : (max_symbol < 4 ? 2 : 4);
+    *num_rows = ok ? num_cells / *width : 0;
+
+    return ok;
+}
+
+// stream the rows of the level, buffering the transitions between them
+static bool spill_level(FILE *file, Spill *spill) {
+    char *chunk = (char*)malloc(CHUNK_SIZE);
+    assert(NULL != chunk);
+
+    char row[64];
+    uint32_t row_len = 0;
+    bool first = true;
+    Bitmap first_map = 0;
+    uint32_t first_orientation = 0;
+    Bitmap prev = 0;
+    uint32_t prev_orientation = 0;
+
+    size_t amount = 0;
+    while ((amount = fread(chunk, 1, CHUNK_SIZE, file)) > 0) {
+        for (size_t index = 0; index < amount; index++) {
+            if (isspace(chunk[index])) {
+                continue;
+            }
+
+            row[row_len++] = chunk[index];
+            if (row_len < spill->width) {
+                continue;
+            }
+            row_len = 0;
+
+            Bitmap map = spill->kernels.pack(spill->width, row);
+            uint32_t orientation = 0;
+            if (spill->mirror) {
+                Bitmap mirrored = bitmap_mirror(map, spill->width, spill->bits_per_cell);
+                if (mirrored < map) {
+                    map = mirrored;
+                    orientation = ROW_MIRRORED;
+                }
+            }
+
+            if (first) {
+                first = false;
+                first_map = map;
+                first_orientation = orientation;
+            } else {
+                spill_row(spill, map, orientation, prev, prev_orientation);
+            }
+
+            prev = map;
+            prev_orientation = orientation;
+        }
+    }
+
+    free(chunk);
+
+    // the level wraps around, as in table_train()
+    if (!first) {
+        spill_row(spill, first_map, first_orientation, prev, prev_orientation);
+    }
+    if (spill->num_pairs > 0) {
+        write_run(spill);
+    }
+
+    return !first;
+}
+
+// each pair of neighbouring rows is a transition in both directions
+static void spill_row(Spill *spill, Bitmap map, uint32_t orientation, Bitmap prev, uint32_t prev_orientation) {
+    uint32_t flip = orientation ^ prev_orientation;
+    add_pair(spill, prev, map, flip);
+    add_pair(spill, map, prev, flip);
+}
+
+static void add_pair(Spill *spill, Bitmap from, Bitmap to, uint32_t flip) {
+    if (spill->num_pairs == spill->capacity) {
+        write_run(spill);
+    }
+
+    Pair *pair = &spill->pairs[spill->num_pairs++];
+    pair->from = from;
+    pair->to = to;
+    pair->flip = flip;
+    pair->count = 1;
+}
+
+// sort the buffered pairs, combine the repeats and write them out as a run
+static void write_run(Spill *spill) {
+    qsort(spill->pairs, spill->num_pairs, sizeof(Pair), compare_pairs);
+
+    uint64_t num_unique = 0;
+    for (uint64_t index = 0; index < spill->num_pairs; index++) {
+        if ((num_unique > 0) && (0 == compare_pairs(&spill->pairs[num_unique - 1], &spill->pairs[index])) &&
+            (spill->pairs[num_unique - 1].count < UINT32_MAX)) {
+            spill->pairs[num_unique - 1].count++;
+        } else {
+            spill->pairs[num_unique++] = spill->pairs[index];
+        }
+    }
+
+    FILE *run = tmpfile();
+    assert(NULL != run);
+    size_t written = fwrite(spill->pairs, sizeof(Pair), num_unique, run);
+    assert(written == num_unique);
+    rewind(run);
+
+    spill->runs = (FILE**)realloc(spill->runs, (spill->num_runs + 1) * sizeof(FILE*));
+    spill->run_levels = (uint32_t*)realloc(spill->run_levels, (spill->num_runs + 1) * sizeof(uint32_t));
+    assert((NULL != spill->runs) && (NULL != spill->run_levels));
+    spill->runs[spill->num_runs] = run;
+    spill->run_levels[spill->num_runs] = 0;
+    spill->num_runs++;
+    spill->runs_written++;
+
+    spill->num_pairs = 0;
+
+    collapse_runs(spill);
+}
+
+// merge the newest MERGE_FANIN runs into one while they have all been
+// merged the same number of times. levels only go down along the list, so
+// at most MERGE_FANIN - 1 runs of each level stay open, and each pair is
+// rewritten once per level.
+static void collapse_runs(Spill *spill) {
+    while (spill->num_runs >= MERGE_FANIN) {
+        uint32_t first = spill->num_runs - MERGE_FANIN;
+        uint32_t level = spill->run_levels[spill->num_runs - 1];
+        if (spill->run_levels[first] != level) {
+            return;
+        }
+
+        FILE *run = tmpfile();
+        assert(NULL != run);
+        merge_runs(&spill->runs[first], MERGE_FANIN, run, NULL);
+        rewind(run);
+
+        for (uint32_t run_index = first; run_index < spill->num_runs; run_index++) {
+            fclose(spill->runs[run_index]);
+        }
+        spill->runs[first] = run;
+        spill->run_levels[first] = level + 1;
+        spill->num_runs = first + 1;
+    }
+}
+
+static int compare_pairs(void const *left, void const *right) {
+    Pair const *a = (Pair const*)left;
+    Pair const *b = (Pair const*)right;
+
+    if (a->from != b->from) {
+        return a->from < b->from ? -1 : 1;
+    }
+    if (a->to != b->to) {
+        return a->to < b->to ? -1 : 1;
+    }
+    if (a->flip != b->flip) {
+        return a->flip < b->flip ? -1 : 1;
+    }
+    return 0;
+}
+
+static void sift_down(Merge *heap, uint32_t size, uint32_t index) {
+    while (true) {
+        uint32_t smallest = index;
+        uint32_t left = 2 * index + 1;
+        uint32_t right = left + 1;
+
+        if ((left < size) && (compare_pairs(&heap[left].pair, &heap[smallest].pair) < 0)) {
+            smallest = left;
+        }
+        if ((right < size) && (compare_pairs(&heap[right].pair, &heap[smallest].pair) < 0)) {
+            smallest = right;
+        }
+        if (smallest == index) {
+            return;
+        }
+
+        Merge swap = heap[index];
+        heap[index] = heap[smallest];
+        heap[smallest] = swap;
+        index = smallest;
+    }
+}
+
+// merge the runs into one sorted stream of unique pairs. unless vocabulary
+// is NULL, also collect the rows that pairs start from. every row starts
+// some pair, so these are all the rows of the model, already in sorted
+// order.
+static uint64_t merge_runs(FILE **runs, uint32_t num_runs, FILE *merged, Bitmap **vocabulary) {
+    Merge *heap = (Merge*)malloc((num_runs + 1) * sizeof(Merge));
+    assert(NULL != heap);
+
+    uint32_t heap_size = 0;
+    for (uint32_t run_index = 0; run_index < num_runs; run_index++) {
+        heap[heap_size].run = runs[run_index];
+        if (fread(&heap[heap_size].pair, sizeof(Pair), 1, runs[run_index]) == 1) {
+            heap_size++;
+        }
+    }
+    for (uint32_t index = heap_size; index > 0; index--) {
+        sift_down(heap, heap_size, index - 1);
+    }
+
+    uint64_t num_rows = 0;
+    uint64_t capacity = 1024;
+    if (NULL != vocabulary) {
+        *vocabulary = (Bitmap*)malloc(capacity * sizeof(Bitmap));
+        assert(NULL != *vocabulary);
+    }
+
+    bool have_pair = false;
+    Pair current;
+    memset(&current, 0, sizeof(current));
+
+    while (heap_size > 0) {
+        Pair next = heap[0].pair;
+        if (fread(&heap[0].pair, sizeof(Pair), 1, heap[0].run) != 1) {
+            heap[0] = heap[--heap_size];
+        }
+        sift_down(heap, heap_size, 0);
+
+        if (have_pair && (0 == compare_pairs(&current, &next))) {
+            uint64_t count = (uint64_t)current.count + next.count;
+            current.count = count > UINT32_MAX ? UINT32_MAX : count;
+            continue;
+        }
+
+        if (have_pair) {
+            size_t written = fwrite(&current, sizeof(Pair), 1, merged);
+            assert(written == 1);
+        }
+
+        if ((NULL != vocabulary) && (!have_pair || (current.from != next.from))) {
+            if (num_rows == capacity) {
+                capacity *= 2;
+                *vocabulary = (Bitmap*)realloc(*vocabulary, capacity * sizeof(Bitmap));
+                assert(NULL != *vocabulary);
+            }
+            (*vocabulary)[num_rows++] = next.from;
+        }
+
+        current = next;
+        have_pair = true;
+    }
+
+    if (have_pair) {
+        size_t written = fwrite(&current, sizeof(Pair), 1, merged);
+        assert(written == 1);
+    }
+
+    free(heap);
+
+    return num_rows;
+}
+
+static uint64_t find_row(Bitmap *vocabulary, uint64_t num_rows, Bitmap bitmap) {
+    uint64_t low = 0;
+    uint64_t high = num_rows;
+    while (low < high) {
+        uint64_t mid = (low + high) / 2;
+        if (vocabulary[mid] < bitmap) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    assert((low < num_rows) && (vocabulary[low] == bitmap));
+    return low;
+}
+
+// write each row's transitions, turning the bitmaps they go to into row
+// indices. a row whose counts would overflow is scaled down, which keeps
+// its probabilities close.
+static bool write_model(FILE *merged, Bitmap *vocabulary, uint64_t num_rows, Spill *spill, FILE *model) {
+    if (num_rows >= ROW_MIRRORED) {
+        fprintf(stderr, "Too many unique rows for one table!\n");
+        return false;
+    }
+
+    uint32_t flags = spill->mirror ? TABLE_MIRROR : 0;
+    bool ok = table_write_header(model, spill->width, spill->bits_per_cell, flags, num_rows);
+
+    uint32_t capacity = 16;
+    Transition *transitions = (Transition*)malloc(capacity * sizeof(Transition));
+    uint64_t *counts = (uint64_t*)malloc(capacity * sizeof(uint64_t));
+    assert((NULL != transitions) && (NULL != counts));
+
+    Pair pair;
+    bool have_pair = fread(&pair, sizeof(Pair), 1, merged) == 1;
+
+    for (uint64_t row_index = 0; ok && (row_index < num_rows); row_index++) {
+        Bitmap from = vocabulary[row_index];
+        uint32_t num_transitions = 0;
+        uint64_t total = 0;
+
+        while (have_pair && (pair.from == from)) {
+            if (num_transitions == capacity) {
+                capacity *= 2;
+                transitions = (Transition*)realloc(transitions, capacity * sizeof(Transition));
+                counts = (uint64_t*)realloc(counts, capacity * sizeof(uint64_t));
+                assert((NULL != transitions) && (NULL != counts));
+            }
+
+            transitions[num_transitions].next_row = find_row(vocabulary, num_rows, pair.to) | pair.flip;
+            counts[num_transitions] = pair.count;
+            total += pair.count;
+            num_transitions++;
+
+            have_pair = fread(&pair, sizeof(Pair), 1, merged) == 1;
+        }
+
+        uint32_t shift = 0;
+        while ((total >> shift) > UINT32_MAX) {
+            shift++;
+        }
+        for (uint32_t trans_index = 0; trans_index < num_transitions; trans_index++) {
+            uint64_t count = counts[trans_index] >> shift;
+            transitions[trans_index].count = count > 0 ? count : 1;
+        }
+
+        ok = table_write_row(model, from, num_transitions, transitions);
+    }
+
+    free(transitions);
+    free(counts);
+
+    return ok;
+}
@@ -0,0 +1,18 @@
+#ifndef DOWNGEN_EXTERNAL
+#define DOWNGEN_EXTERNAL
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+#define DEFAULT_MEMORY_MB 256
+
+
+// train a table from a level file without holding the level in memory,
+// writing the model to model_name in the format table_load() reads. the
+// level is streamed, its transitions are spilled to sorted runs on disk
+// whenever memory_budget bytes of them are buffered, and the runs are
+// merged into the model. only the model's rows are held in memory at once.
+bool external_train(char const *level_name, char const *model_name, uint32_t flags, uint64_t memory_budget);
+
+#endif
@@ -0,0 +1,329 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "gifenc.h"
+
+#include "generate.h"
+#include "rng.h"
+
+
+// multiplier of the rolling hash over the rows in view
+#define HASH_BASE 0x100000001B3ULL
+
+
+static void *render_gif(void *arg);
+static CachedFrame *frame_slot(FrameCache *cache, uint16_t w, uint16_t h, uint16_t x, uint16_t y);
+static CachedFrame *find_frame(FrameCache *cache, uint16_t w, uint16_t h, uint16_t x, uint16_t y);
+
+
+void generate_gif(Config *config, Table *table, Walk *walk, uint32_t height, int fd) {
+    generate_gifs(config, table, walk, height, 1, &config->dim, &fd);
+}
+
+// the walk is run once, up front, so every output shows the same rows. the
+// rows take far less memory than the frames they are encoded into.
+void generate_gifs(Config *config, Table *table, Walk *walk, uint32_t height,
+                   uint32_t num_outputs, int const *dims, int const *fds) {
+    uint64_t num_rows = (uint64_t)height + config->num_frames;
+    uint32_t *rows = (uint32_t*)malloc(num_rows * sizeof(uint32_t));
+    assert(NULL != rows);
+
+    for (uint64_t row_index = 0; row_index < num_rows; row_index++) {
+        rows[row_index] = walk_next(walk, table);
+    }
+
+    GifOutput *outputs = (GifOutput*)calloc(num_outputs, sizeof(GifOutput));
+    assert(NULL != outputs);
+
+    for (uint32_t output_index = 0; output_index < num_outputs; output_index++) {
+        GifOutput *output = &outputs[output_index];
+        output->config = *config;
+        output->config.dim = dims[output_index];
+        output->table = table;
+        output->rows = rows;
+        output->height = height;
+        output->fd = fds[output_index];
+    }
+
+    // each size is rendered and encoded on its own thread
+    if (num_outputs == 1) {
+        render_gif(&outputs[0]);
+    } else {
+        for (uint32_t output_index = 0; output_index < num_outputs; output_index++) {
+            int retval = pthread_create(&outputs[output_index].thread, NULL, render_gif, &outputs[output_index]);
+            assert(0 == retval);
+        }
+        for (uint32_t output_index = 0; output_index < num_outputs; output_index++) {
+            pthread_join(outputs[output_index].thread, NULL);
+        }
+    }
+
+    free(outputs);
+    free(rows);
+}
+
+static void *render_gif(void *arg) {
+    GifOutput *output = (GifOutput*)arg;
+    Config *config = &output->config;
+    Table *table = output->table;
+
+    uint8_t palette[] = 
+    {
+        0x00, 0x00, 0x00, /* 0 -> black */
+        0x00, 0xFF, 0x00, /* 1 -> green */
+        0xFF, 0x00, 0x00, /* 2 -> red */
+        0x00, 0x00, 0xFF, /* 3 -> blue */
+        0xFF, 0xFF, 0x00, /* 4 -> yellow */
+        0xFF, 0x00, 0xFF, /* 5 -> magenta */
+        0x00, 0xFF, 0xFF, /* 6 -> cyan */
+        0xFF, 0xFF, 0xFF, /* 7 -> white */
+        0xFF, 0x80, 0x00, /* 8 -> orange */
+        0x80, 0x00, 0xFF, /* 9 -> purple */
+        0x80, 0x80, 0x80, /* A -> grey */
+        0x00, 0x80, 0x00, /* B -> dark green */
+        0x80, 0x00, 0x00, /* C -> dark red */
+        0x00, 0x00, 0x80, /* D -> dark blue */
+        0x80, 0x80, 0x00, /* E -> olive */
+        0xFF, 0x80, 0x80, /* F -> pink */
+    };
+
+    // up to four tile types fit the smallest palette gifenc allows. frames
+    // are packed at the table's bits per cell, down to one bit per pixel.
+    int depth = table->bits_per_cell <= 2 ? 2 : 4;
+
+    Image *image = image_create(table->row_width, output->height);
+    assert(NULL != image);
+
+    ge_GIF *gif = ge_new_gif_packed(output->fd, image->width * config->dim, image->height * config->dim,
+                                    palette, depth, LOOP_SETTING, table->bits_per_cell);
+    assert(NULL != gif);
+    ge_set_clear_policy(gif, config->clear_policy);
+
+    ScaleRowFn scale_row = scale_row_kernel(gif->bits);
+    FrameCache *cache = frame_cache_create(image->height);
+    uint32_t const *rows = output->rows;
+
+    // fill the initial grid up with rows
+    for (uint32_t row_index = 0; row_index < image->height; row_index++) {
+        scroll(image);
+
+        table_copy_row(table, rows[row_index], image);
+        frame_cache_push(cache, rows[row_index]);
+    }
+
+    // start with this filled image
+    emit_frame(gif, config->speed, config->dim, scale_row, image, cache);
+
+    // run each frame- scroll up one row and fill in the last row with the
+    // next row of the level
+    for (uint32_t frame_index = 0; frame_index < config->num_frames; frame_index++) {
+        uint32_t row = rows[image->height + frame_index];
+
+        scroll(image);
+        table_copy_row(table, row, image);
+        frame_cache_push(cache, row);
+
+        emit_frame(gif, config->speed, config->dim, scale_row, image, cache);
+    }
+
+    // clean up
+    frame_cache_destroy(&cache);
+    ge_close_gif(gif);
+    image_destroy(&image);
+
+    return NULL;
+}
+
+void emit_frame(ge_GIF *gif, int speed, uint32_t dim, ScaleRowFn scale_row, Image *image, FrameCache *cache) {
+    uint32_t stride = gif->stride;
+
+    // scale each row once, then copy the scanline down for the rest of
+    // the block
+    for (uint32_t y = 0; y < image->height; y++) {
+        uint64_t *line = &gif->frame[y * dim * stride];
+        scale_row(image->width, dim, &image->data[y * image->width], line);
+
+        for (uint32_t h = 1; h < dim; h++) {
+            memcpy(&line[h * stride], line, stride * sizeof(uint64_t));
+        }
+    }
+
+    // a frame that has not changed only extends the one before it. one that
+    // has is encoded, unless the same rows were seen in view before with the
+    // same change.
+    uint16_t w, h, x, y;
+    if (!ge_get_bbox(gif, &w, &h, &x, &y)) {
+        ge_add_image(gif, speed, NULL, 0);
+        return;
+    }
+
+    CachedFrame *frame = find_frame(cache, w, h, x, y);
+    if (NULL != frame) {
+        cache->hits++;
+        ge_add_image(gif, speed, frame->data, frame->size);
+        return;
+    }
+    cache->misses++;
+
+    size_t size = 0;
+    uint8_t const *data = ge_encode_image(gif, w, h, x, y, &size);
+
+    // replace whatever was in this frame's slot
+    frame = frame_slot(cache, w, h, x, y);
+    if (frame->capacity < size) {
+        frame->capacity = size;
+        frame->data = (uint8_t*)realloc(frame->data, frame->capacity);
+        assert(NULL != frame->data);
+    }
+    memcpy(frame->data, data, size);
+    frame->size = size;
+    memcpy(frame->rows, cache->rows, cache->height * sizeof(uint32_t));
+    frame->hash = cache->hash;
+    frame->w = w;
+    frame->h = h;
+    frame->x = x;
+    frame->y = y;
+
+    ge_add_image(gif, speed, data, size);
+}
+
+// each frame has one slot, from the rows in view and the box
+static CachedFrame *frame_slot(FrameCache *cache, uint16_t w, uint16_t h, uint16_t x, uint16_t y) {
+    uint64_t box = ((uint64_t)w << 48) | ((uint64_t)h << 32) | ((uint64_t)x << 16) | y;
+    return &cache->frames[rng_mix(cache->hash ^ box) & (FRAME_CACHE_SIZE - 1)];
+}
+
+static CachedFrame *find_frame(FrameCache *cache, uint16_t w, uint16_t h, uint16_t x, uint16_t y) {
+    CachedFrame *frame = frame_slot(cache, w, h, x, y);
+
+    bool match = (frame->size > 0) && (frame->hash == cache->hash) &&
+                 (frame->w == w) && (frame->h == h) && (frame->x == x) && (frame->y == y) &&
+                 (0 == memcmp(frame->rows, cache->rows, cache->height * sizeof(uint32_t)));
+
+    return match ? frame : NULL;
+}
+
+FrameCache *frame_cache_create(uint32_t height) {
+    FrameCache *cache = (FrameCache*)calloc(1, sizeof(FrameCache));
+    assert(NULL != cache);
+
+    // rows start out empty, as the image does
+    cache->height = height;
+    cache->rows = (uint32_t*)calloc(height, sizeof(uint32_t));
+    assert(NULL != cache->rows);
+
+    cache->oldest_power = 1;
+    for (uint32_t row_index = 1; row_index < height; row_index++) {
+        cache->oldest_power *= HASH_BASE;
+    }
+
+    for (uint32_t frame_index = 0; frame_index < FRAME_CACHE_SIZE; frame_index++) {
+        cache->frames[frame_index].rows = (uint32_t*)malloc(height * sizeof(uint32_t));
+        assert(NULL != cache->frames[frame_index].rows);
+    }
+
+    return cache;
+}
+
+void frame_cache_destroy(FrameCache **cache) {
+    for (uint32_t frame_index = 0; frame_index < FRAME_CACHE_SIZE; frame_index++) {
+        free((*cache)->frames[frame_index].rows);
+        free((*cache)->frames[frame_index].data);
+    }
+    free((*cache)->rows);
+    free(*cache);
+    *cache = NULL;
+}
+
+// the hash is the rows in view as the digits of a number in base HASH_BASE,
+// oldest first, so the oldest row's digit can be taken away as it leaves
+void frame_cache_push(FrameCache *cache, uint32_t row) {
+    cache->hash -= cache->rows[0] * cache->oldest_power;
+    cache->hash = cache->hash * HASH_BASE + row;
+
+    memmove(cache->rows, &cache->rows[1], (cache->height - 1) * sizeof(uint32_t));
+    cache->rows[cache->height - 1] = row;
+}
+
+// the cells are palette indices, so multiplying by a word of ones repeats
+// the index in every pixel of the word. pixels never straddle words, so the
+// same word fills every word a block covers.
+static uint64_t const pixel_ones[] = {
+    0, 0xFFFFFFFFFFFFFFFFULL, 0x5555555555555555ULL, 0, 0x1111111111111111ULL,
+    0, 0, 0, 0x0101010101010101ULL,
+};
+
+#define SCALE_KERNEL(BITS)                                                                  \
+    static void scale_row_##BITS(uint32_t width, uint32_t dim, uint8_t const *cells, uint64_t *pixels) { \
+        uint64_t word = 0;                                                                  \
+        uint32_t offset = 0;                                                                \
+        for (uint32_t x = 0; x < width; x++) {                                              \
+            uint64_t block = cells[x] * pixel_ones[BITS];                                   \
+            uint32_t run = dim * BITS;                                                      \
+            while (run > 0) {                                                               \
+                uint32_t take = run < (64 - offset) ? run : (64 - offset);                  \
+                uint64_t mask = take == 64 ? ~0ULL : ((1ULL << take) - 1) << offset;        \
+                word |= block & mask;                                                       \
+                offset += take;                                                             \
+                run -= take;                                                                \
+                if (offset == 64) {                                                         \
+                    *pixels++ = word;                                                       \
+                    word = 0;                                                               \
+                    offset = 0;                                                             \
+                }                                                                           \
+            }                                                                               \
+        }                                                                                   \
+        if (offset > 0) {                                                                   \
+            *pixels = word;                                                                 \
+        }                                                                                   \
+    }
+
+SCALE_KERNEL(1)
+SCALE_KERNEL(2)
+SCALE_KERNEL(4)
+SCALE_KERNEL(8)
+
+ScaleRowFn scale_row_kernel(uint32_t bits) {
+    switch (bits) {
+        case 1: return scale_row_1;
+        case 2: return scale_row_2;
+        case 4: return scale_row_4;
+        default: return scale_row_8;
+    }
+}
+
+void scroll(Image *image) {
+    for (uint32_t y = 0; y < (image->height - 1); y++) {
+        for (uint32_t x = 0; x < image->width; x++) {
+            uint32_t index = x + y * image->width;
+
+            image->data[index] = image->data[x + (y + 1) * image->width];
+        }
+    }
+
+    for (uint32_t x = 0; x < image->width; x++) {
+        uint32_t index = x + (image->height - 1) * image->width;
+        image->data[index] = 0;
+    }
+}
+
+Image *image_create(uint32_t width, uint32_t height) {
+    Image *image = (Image*)calloc(1, sizeof(Image));
+
+    image->width = width;
+    image->height = height;
+
+    image->data = (uint8_t*)calloc(1, width * height * sizeof(uint8_t));
+
+    return image;
+}
+
+void image_destroy(Image **image) {
+    free((*image)->data);
+    free(*image);
+    *image = NULL;
+}
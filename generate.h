@@ -0,0 +1,102 @@
+#ifndef DOWNGEN_GENERATE
+#define DOWNGEN_GENERATE
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "gifenc.h"
+
+#include "table.h"
+#include "walk.h"
+
+
+#define LOOP_SETTING 0
+
+// number of encoded frames kept by a FrameCache. a power of two.
+#define FRAME_CACHE_SIZE 64
+
+
+typedef struct Config {
+    int dim;
+    int speed;
+    uint32_t num_frames;
+    // when to start a new LZW dictionary, one of gifenc's GE_CLEAR_ values
+    int clear_policy;
+} Config;
+
+
+// an encoded image block, along with the rows in view and the box of the
+// frame it was encoded from, to check a hit against
+typedef struct CachedFrame {
+    uint64_t hash;
+    uint16_t x, y, w, h;
+    uint32_t *rows;
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+} CachedFrame;
+
+// the walk often revisits the same rows, giving the same frame again, so
+// encoded frames are kept by the rows in view when they were drawn. these
+// are tracked with a rolling hash as rows scroll in.
+typedef struct FrameCache {
+    uint32_t height;
+    uint32_t *rows;
+    uint64_t hash;
+    uint64_t oldest_power;
+
+    uint32_t hits;
+    uint32_t misses;
+    CachedFrame frames[FRAME_CACHE_SIZE];
+} FrameCache;
+
+
+// one of the GIFs written from a level by generate_gifs()
+typedef struct GifOutput {
+    Config config;
+    Table *table;
+    uint32_t const *rows;
+    uint32_t height;
+    int fd;
+    pthread_t thread;
+} GifOutput;
+
+
+// expand a row of width palette indices into a packed scanline of width * dim
+// pixels, as ge_GIF frames hold them
+typedef void (*ScaleRowFn)(uint32_t width, uint32_t dim, uint8_t const *cells, uint64_t *pixels);
+
+
+// emit a frame into the given GIF
+//   speed is the number of 10 ms increments per frame
+//   dim is the dimensions (width and height) of each pixel, to allow larger images
+//   scale_row is the kernel for the gif's bits per pixel, from scale_row_kernel()
+//   image is a width * height grid of indices into the gif's color palette
+//   cache holds the rows the image was drawn from, and their encoded frames
+void emit_frame(ge_GIF *gif, int speed, uint32_t dim, ScaleRowFn scale_row, Image *image, FrameCache *cache);
+
+FrameCache *frame_cache_create(uint32_t height);
+void frame_cache_destroy(FrameCache **cache);
+
+// scroll a row into the rows in view
+void frame_cache_push(FrameCache *cache, uint32_t row);
+
+// choose the row scaling kernel for a number of bits per pixel, which
+// writes each block a word at a time
+ScaleRowFn scale_row_kernel(uint32_t bits);
+
+void scroll(Image *image);
+
+// write a scrolling GIF, height rows tall, of the level produced by the walk
+// to fd, which is closed afterwards. the caller holds the table's read lock.
+void generate_gif(Config *config, Table *table, Walk *walk, uint32_t height, int fd);
+
+// the same, writing one level to num_outputs GIFs at once, each with the
+// block size in dims and written to the descriptor in fds
+void generate_gifs(Config *config, Table *table, Walk *walk, uint32_t height,
+                   uint32_t num_outputs, int const *dims, int const *fds);
+
+Image *image_create(uint32_t width, uint32_t height);
+void image_destroy(Image **image);
+
+#endif
@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <ctype.h>
+
+#include "bitmap.h"
+
+#include "level.h"
+
+
+char *parse_level(const char * const level_string, uint32_t *level_width, uint32_t *level_height) {
+    assert(NULL != level_width);
+    assert(NULL != level_height);
+
+    uint32_t level_len = strlen(level_string);
+
+    uint32_t num_level_chars = 0;
+    *level_width = 0;
+    *level_height = 0;
+    for (uint32_t chr_index = 0; chr_index < level_len; chr_index++) {
+        if (isspace(level_string[chr_index])) {
+            if (*level_width == 0) {
+                // if the level starts with a space, it is invalid
+                if (0 == chr_index) {
+                    fprintf(stderr, "A level must not start with whitespace!\n");
+                    return NULL;
+                }
+
+                *level_width = chr_index;
+            }
+        } else {
+            if (bitmap_symbol(level_string[chr_index]) < 0) {
+                fprintf(stderr, "Character '%c' is invalid in a level file!\n", level_string[chr_index]);
+                return NULL;
+            }
+            num_level_chars++;
+        }
+    }
+
+    // a single line with no whitespace after it
+    if (*level_width == 0) {
+        *level_width = num_level_chars;
+    }
+
+    // count the rows from the cells, so blank lines and '\r\n' line endings
+    // do not add rows that are not there
+    if ((*level_width == 0) || ((num_level_chars % *level_width) != 0)) {
+        fprintf(stderr, "Every line of a level must have the same number of characters!\n");
+        return NULL;
+    }
+    *level_height = num_level_chars / *level_width;
+
+    uint8_t *level = (uint8_t*)calloc(1, num_level_chars);
+    if (NULL == level) {
+        fprintf(stderr, "Not enough memory for a level of %d rows!\n", *level_height);
+        return NULL;
+    }
+
+    uint32_t level_index = 0;
+    for (uint32_t chr_index = 0; chr_index < level_len; chr_index++) {
+        if (!isspace(level_string[chr_index])) {
+            level[level_index] = level_string[chr_index];
+            level_index++;
+        }
+    }
+    
+    return level;
+}
+
+char *read_file(char *file_name) {
+    FILE *file = fopen(file_name, "r");
+
+    if (NULL == file) {
+        fprintf(stderr, "Could not open '%s'!\n", file_name);
+        exit(0);
+    }
+
+    // get file size
+    int retval = 0;
+    retval = fseek(file, 0, SEEK_END);
+    assert(0 == retval);
+
+    int file_size = ftell(file);
+    assert(file_size > 0);
+
+    retval = fseek(file, 0, SEEK_SET);
+    assert(0 == retval);
+
+    // allocate space for file data
+    char *file_data = (char*)calloc(1, file_size + 1);
+    assert(NULL != file_data);
+
+    // read in full file
+    int read_result = fread(file_data, 1, file_size, file);
+    assert(read_result == file_size);
+
+    file_data[file_size - 1] = '\0';
+
+    return file_data;
+}
@@ -0,0 +1,10 @@
+#ifndef DOWNGEN_LEVEL
+#define DOWNGEN_LEVEL
+
+#include <stdint.h>
+
+
+char *read_file(char *file_name);
+char *parse_level(const char * const level_string, uint32_t *level_width, uint32_t *level_height);
+
+#endif
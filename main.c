@@ -5,28 +5,39 @@
 #include <string.h>
 #include <assert.h>
 #include <time.h>
-
-#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "optfetch.h"
 #include "gifenc.h"
 
+#include "analysis.h"
+#include "batch.h"
+#include "bitmap.h"
+#include "bridge.h"
+#include "compact.h"
+#include "external.h"
+#include "generate.h"
+#include "level.h"
+#include "novelty.h"
+#include "server.h"
 #include "table.h"
+#include "walk.h"
 
 
 #define DEFAULT_DIM 20
 #define DEFAULT_SPEED 10
-#define LOOP_SETTING 0
 #define NUM_FRAMES 500
 
 #define GIF_NAME "level.gif"
+// the name of each gif when there are several sizes
+#define GIF_DIM_NAME "level_%d.gif"
+#define MAX_DIMS 8
 #define DEFAULT_OUT_HEIGHT 50
 
+// tables with more rows than this are too big to print as a matrix
+#define MAX_PRINT_ROWS 32
 
-typedef struct Config {
-    int dim;
-    int speed;
-} Config;
 
 #define WIDTH 9
 #define HEIGHT 15
@@ -50,292 +61,601 @@ char const * const gv_test_level =
     };
 
 
-// emit a frame into the given GIF
-//   speed is the number of 10 ms increments per frame
-//   dim is the dimensions (width and height) of each pixel, to allow larger images
-//   width is the width of the given grid of color values
-//   height is the height of the given grid of color values
-//   grid is a width * height array of indices into the gif's color palette
-void emit_frame(ge_GIF *gif, int speed, uint32_t dim, Image *image);
-
-void scroll(Image *image);
-void generate_gif(Config *config, char *level, Table *table, Image *image);
-
-char *read_file(char *file_name);
-char *parse_level(const char * const level_string, uint32_t *level_width, uint32_t *level_height);
 void print_usage(void);
-
-Image *image_create(uint32_t width, uint32_t height);
-void image_destroy(Image **image);
+void generate_pool(Table *table, uint32_t num_levels, uint32_t num_rows, uint64_t seed);
+void generate_bridges(Table *table, uint32_t num_levels, uint32_t num_rows, uint64_t seed,
+                      char const *from_string, char const *to_string);
+Table *load_table(char *file_name, uint32_t flags, uint32_t max_copy, uint32_t num_threads);
+Table *load_model(char *model_file);
+Table *compact_model(Table *table, int merge_distance, int prune_count);
+uint32_t parse_dims(char const *dim_option, int *dims);
 
 int main(int argc, char *argv[]) {
     assert(WIDTH <= 64);
 
-    srand(time(NULL));
-
     int out_height_int = DEFAULT_OUT_HEIGHT;
     char *file_name = NULL;
+    char *serve_path = NULL;
+    char *connect_path = NULL;
+    int num_workers = DEFAULT_WORKERS;
+    unsigned long long seed_option = 0;
+    unsigned long long start_row = 0;
+    char *checkpoint_file = NULL;
+    int checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL;
     bool print_help = false;
     bool print_table = false;
+    bool mirror = false;
+    int pool_levels = 0;
+    int pool_rows = DEFAULT_OUT_HEIGHT;
+    char *json_file = NULL;
+    char *save_file = NULL;
+    char *model_file = NULL;
+    char *source_file = NULL;
+    bool external = false;
+    int memory_mb = DEFAULT_MEMORY_MB;
+    int max_copy = DEFAULT_MAX_COPY;
+    int merge_distance = 0;
+    int prune_count = 0;
+    int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    char *dim_option = NULL;
+    char *clear_option = NULL;
+    char *from_string = NULL;
+    char *to_string = NULL;
+    int dims[MAX_DIMS];
     Config config;
     config.dim = DEFAULT_DIM;
     config.speed = DEFAULT_SPEED;
+    config.num_frames = NUM_FRAMES;
+    // scaled up blocks repeat a lot, so a full dictionary stays useful
+    config.clear_policy = GE_CLEAR_RATIO;
 
     struct opttype opts[] = {
         {"height", 'h', OPTTYPE_INT, &out_height_int},
-        {"dim", 'd', OPTTYPE_INT, &config.dim},
+        {"dim", 'd', OPTTYPE_STRING, &dim_option},
         {"file", 'f', OPTTYPE_STRING, &file_name},
         {"speed", 's', OPTTYPE_INT, &config.speed},
+        {"clear", 0, OPTTYPE_STRING, &clear_option},
         {"print", 'p', OPTTYPE_BOOL, &print_table},
+        {"mirror", 'm', OPTTYPE_BOOL, &mirror},
+        {"pool", 0, OPTTYPE_INT, &pool_levels},
+        {"rows", 'r', OPTTYPE_INT, &pool_rows},
+        {"from", 0, OPTTYPE_STRING, &from_string},
+        {"to", 0, OPTTYPE_STRING, &to_string},
+        {"json", 'j', OPTTYPE_STRING, &json_file},
+        {"threads", 't', OPTTYPE_INT, &num_threads},
+        {"seed", 0, OPTTYPE_ULONGLONG, &seed_option},
+        {"start", 0, OPTTYPE_ULONGLONG, &start_row},
+        {"checkpoints", 'c', OPTTYPE_STRING, &checkpoint_file},
+        {"interval", 'i', OPTTYPE_INT, &checkpoint_interval},
+        {"save", 0, OPTTYPE_STRING, &save_file},
+        {"model", 0, OPTTYPE_STRING, &model_file},
+        {"source", 0, OPTTYPE_STRING, &source_file},
+        {"external", 'x', OPTTYPE_BOOL, &external},
+        {"memory", 0, OPTTYPE_INT, &memory_mb},
+        {"copy", 0, OPTTYPE_INT, &max_copy},
+        {"merge", 0, OPTTYPE_INT, &merge_distance},
+        {"prune", 0, OPTTYPE_INT, &prune_count},
+        {"serve", 0, OPTTYPE_STRING, &serve_path},
+        {"connect", 0, OPTTYPE_STRING, &connect_path},
+        {"workers", 'w', OPTTYPE_INT, &num_workers},
         {"help", 'h', OPTTYPE_BOOL, &print_help},
+        {NULL, 0, 0, NULL},
     };
     fetchopts(&argc, &argv, opts);
-    if (print_help || (argc != 0)) {
+
+    // only the server and client take positional arguments
+    bool extra_args = (argc != 0) && (NULL == serve_path) && (NULL == connect_path);
+    if (print_help || extra_args) {
         print_usage();
         exit(0);
     }
 
-    // we could use OPTTYPE_ULONG or something for out_height,
-    // but lets just not.
-    uint32_t out_height = out_height_int;
+    if (NULL != connect_path) {
+        return server_request(connect_path, argc, &argv[1]);
+    }
 
-    char *level = NULL;
-    uint32_t level_width = 0;
-    uint32_t level_height = 0;
+    uint32_t num_dims = 1;
+    dims[0] = DEFAULT_DIM;
+    if (NULL != dim_option) {
+        num_dims = parse_dims(dim_option, dims);
+        if (num_dims == 0) {
+            fprintf(stderr, "--dim must be up to %d sizes above 0, separated by commas!\n", MAX_DIMS);
+            exit(0);
+        }
+    }
+    config.dim = dims[0];
 
-    if (NULL == file_name) {
-        level = parse_level(gv_test_level, &level_width, &level_height);
-    } else {
-        char *level_string = read_file(file_name);
-        level = parse_level(level_string, &level_width, &level_height);
-        free(level_string);
+    if (NULL != clear_option) {
+        if (0 == strcmp(clear_option, "full")) {
+            config.clear_policy = GE_CLEAR_FULL;
+        } else if (0 == strcmp(clear_option, "ratio")) {
+            config.clear_policy = GE_CLEAR_RATIO;
+        } else {
+            fprintf(stderr, "--clear must be 'full' or 'ratio'!\n");
+            exit(0);
+        }
     }
-    assert(NULL != level);
 
-    if (level_width > 64)
-    {
-        printf("Level width must be < 64 (was %d)!\n", level_width);
+    if (num_workers < 1) {
+        fprintf(stderr, "--workers must be at least 1!\n");
         exit(0);
     }
 
-    Image *image = image_create(level_width, out_height);
-    assert(NULL != image);
+    uint32_t table_flags = 0;
+    if (mirror) {
+        table_flags |= TABLE_MIRROR;
+    }
+
+    if (max_copy < 0) {
+        max_copy = 0;
+    }
+
+    // we could use OPTTYPE_ULONG or something for out_height,
+    // but lets just not.
+    uint32_t out_height = out_height_int;
+    uint32_t train_threads = num_threads > 0 ? num_threads : 1;
+
+    if (NULL != serve_path) {
+        // each level file given is served as a model of the same name.
+        // without any, the usual input is served as 'default'.
+        uint32_t num_models = argc > 0 ? argc : 1;
+        Model *models = (Model*)calloc(num_models, sizeof(Model));
+        assert(NULL != models);
+
+        if (argc > 0) {
+            for (int model_index = 0; model_index < argc; model_index++) {
+                models[model_index].name = argv[model_index + 1];
+                models[model_index].table = load_table(argv[model_index + 1], table_flags, max_copy, train_threads);
+                models[model_index].table = compact_model(models[model_index].table, merge_distance, prune_count);
+            }
+        } else {
+            models[0].name = "default";
+            models[0].table = load_table(file_name, table_flags, max_copy, train_threads);
+            models[0].table = compact_model(models[0].table, merge_distance, prune_count);
+        }
+
+        server_run(serve_path, &config, out_height, models, num_models, num_workers);
 
-    Table *table = table_create(level_width, level_height, level);
-    assert(NULL != table);
+        for (uint32_t model_index = 0; model_index < num_models; model_index++) {
+            table_destroy(&models[model_index].table);
+        }
+        free(models);
 
-    if (print_table) {
-        table_print(table);
+        return 0;
     }
 
-    // The main event!
-    generate_gif(&config, level, table, image);
+    // a level too big for memory is trained into the saved model file, which
+    // is then loaded like any other
+    Table *table = NULL;
+    if (external) {
+        if ((NULL == file_name) || (NULL == save_file)) {
+            fprintf(stderr, "--external needs both --file and --save!\n");
+            exit(0);
+        }
 
-    // Clean Up
-    table_destroy(&table);
+        uint64_t memory_budget = (uint64_t)(memory_mb > 0 ? memory_mb : DEFAULT_MEMORY_MB) << 20;
+        if (!external_train(file_name, save_file, table_flags, memory_budget)) {
+            exit(0);
+        }
+        table = load_model(save_file);
+    } else if (NULL != model_file) {
+        table = load_model(model_file);
+    } else {
+        table = load_table(file_name, table_flags, max_copy, train_threads);
+    }
 
-    image_destroy(&image);
+    Table *trained = table;
+    table = compact_model(table, merge_distance, prune_count);
 
-    free(level);
+    // an externally trained table is already saved, unless it was compacted
+    bool saved = external && (table == trained);
+    if ((NULL != save_file) && !saved && !table_save(table, save_file)) {
+        fprintf(stderr, "Could not write '%s'!\n", save_file);
+    }
 
-    return 0;
-}
+    // the source is compiled into a binary by 'make downgen-embedded'
+    if (NULL != source_file) {
+        if (!table_write_source(table, source_file)) {
+            fprintf(stderr, "Could not write '%s'!\n", source_file);
+        }
+        table_destroy(&table);
+        return 0;
+    }
 
-void generate_gif(Config *config, char *level, Table *table, Image *image) {
-    uint8_t palette[] = 
-    {
-        0x00, 0x00, 0x00, /* 0 -> black */
-        0x00, 0xFF, 0x00, /* 2 -> green */
-        0xFF, 0x00, 0x00, /* 1 -> red */
-        0x00, 0x00, 0xFF, /* 3 -> blue */
-    };
+    if (print_table || (NULL != json_file)) {
+        if (print_table && (table->num_rows <= MAX_PRINT_ROWS)) {
+            table_print(table);
+        }
 
-    ge_GIF *gif =
-        ge_new_gif(GIF_NAME, image->width * config->dim, image->height * config->dim, palette, 2, LOOP_SETTING);
+        Analysis *analysis = analysis_create(table, num_threads > 0 ? num_threads : 1);
 
-    // initialize to a random row
-    uint32_t current_row = rand() % table->num_rows;
+        if (print_table) {
+            analysis_print(analysis, table);
+        }
+        if ((NULL != json_file) && !analysis_write_json(analysis, table, json_file)) {
+            fprintf(stderr, "Could not write '%s'!\n", json_file);
+        }
 
-    // fill the initial grid up with rows
-    for (uint32_t row_index = 0; row_index < image->height; row_index++) {
-        scroll(image);
+        analysis_destroy(&analysis);
+    }
 
-        table_copy_row(table, current_row, image);
-        current_row = table_next_row(table, current_row);
+    uint64_t seed = seed_option;
+    if (0 == seed) {
+        seed = time(NULL);
     }
 
-    // start with this filled image
-    emit_frame(gif, config->speed, config->dim, image);
+    // levels joining given rows are printed as a pool is
+    if ((NULL != from_string) || (NULL != to_string)) {
+        generate_bridges(table, pool_levels > 0 ? pool_levels : 1, pool_rows > 0 ? pool_rows : DEFAULT_OUT_HEIGHT,
+                         seed, from_string, to_string);
 
-    // run each frame- scroll up one row and fill in the last row with an
-    // entry from the table
-    for (uint32_t frame_index = 0; frame_index < NUM_FRAMES; frame_index++) {
-        scroll(image);
-        table_copy_row(table, current_row, image);
-        current_row = table_next_row(table, current_row);
-        emit_frame(gif, config->speed, config->dim, image);
+        table_destroy(&table);
+
+        return 0;
     }
 
-    // clean up
-    ge_close_gif(gif);
-}
+    if (pool_levels > 0) {
+        generate_pool(table, pool_levels, pool_rows > 0 ? pool_rows : DEFAULT_OUT_HEIGHT, seed);
 
-void print_usage(void) {
-    printf("Usage: downgen [OPTION]...\n");
-    printf("  Create a gif of a vertically scrolling level from a given input level\n");
-    printf("\n");
-    printf("  --file, -f FILE    Use the given file as the input.\n");
-    printf("                     The file should contain 0's and 1's, one column per\n");
-    printf("                     line, with the same number of characters in each line\n");
-    printf("  --dim,-d  N        Set the GIF dimensions (width and height in pixels of each block.\n");
-    printf("                     For example, 5 makes each cell in the output a 5x5 pixel block\n");
-    printf("                     Defaults to %d.\n", DEFAULT_DIM);
-    printf("  --height,-h N      Set the number of rows in the output image\n");
-    printf("                     Defaults to %d\n", DEFAULT_OUT_HEIGHT);
-    printf("  --speed,-s N       Set the speed of the gif- 1 means 10ms per frame\n");
-    printf("                     Defaults to %d\n", DEFAULT_SPEED);
-    printf("  --print,-p         Print out transition table information\n");
-    printf("  --help             Print this help message\n");
-    printf("\n");
-}
+        table_destroy(&table);
 
-char *parse_level(const char * const level_string, uint32_t *level_width, uint32_t *level_height) {
-    assert(NULL != level_width);
-    assert(NULL != level_height);
+        return 0;
+    }
 
-    uint32_t level_len = strlen(level_string);
+    // reuse the checkpoints from an earlier run of the same level, unless
+    // they were for another table or another seed
+    Checkpoints *checkpoints = NULL;
+    if (NULL != checkpoint_file) {
+        checkpoints = checkpoints_load(checkpoint_file);
 
-    uint32_t num_level_chars = 0;
-    *level_width = 0;
-    *level_height = 0;
-    for (uint32_t chr_index = 0; chr_index < level_len; chr_index++) {
-        if (isspace(level_string[chr_index])) {
-            if (*level_width == 0) {
-                // if the level starts with a space, it is invalid
-                assert(0 != chr_index);
+        if ((NULL != checkpoints) &&
+            (!checkpoints_match(checkpoints, table) ||
+             ((0 != seed_option) && (checkpoints->seed != seed_option)))) {
+            checkpoints_destroy(&checkpoints);
+        }
 
-                *level_width = chr_index;
+        if (NULL == checkpoints) {
+            if (checkpoint_interval <= 0) {
+                checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL;
             }
+            checkpoints = checkpoints_create(table, seed, checkpoint_interval);
+        }
+        seed = checkpoints->seed;
+    }
 
-            if (level_string[chr_index] == '\n') {
-                *level_height = *level_height + 1;
-            }
-        } else {
-            if ((level_string[chr_index] != '0') &&
-                (level_string[chr_index] != '1')) {
-                fprintf(stderr, "Character '%c' is invalid in a level file!\n", level_string[chr_index]);
-                return NULL;
-            }
-            num_level_chars++;
+    Walk walk;
+    walk_start(&walk, table, seed);
+    if (NULL != checkpoints) {
+        walk_seek(&walk, table, checkpoints, start_row);
+    } else {
+        while (walk.row_index < start_row) {
+            walk_next(&walk, table);
         }
     }
+    walk.checkpoints = checkpoints;
+
+    // several sizes each get their own gif, named for the size
+    int gif_fds[MAX_DIMS];
+    for (uint32_t dim_index = 0; dim_index < num_dims; dim_index++) {
+        char gif_name[64];
+        if (num_dims == 1) {
+            snprintf(gif_name, sizeof(gif_name), "%s", GIF_NAME);
+        } else {
+            snprintf(gif_name, sizeof(gif_name), GIF_DIM_NAME, dims[dim_index]);
+        }
 
-    // check for no trailing newline- in this case add one to level height
-    // for the last line
-    if (!isspace(level_string[level_len])) {
-        *level_height = *level_height + 1;
+        gif_fds[dim_index] = creat(gif_name, 0666);
+        if (gif_fds[dim_index] < 0) {
+            fprintf(stderr, "Could not create '%s'!\n", gif_name);
+            exit(0);
+        }
     }
 
-    uint8_t *level = (uint8_t*)calloc(1, num_level_chars);
-    assert(NULL != level);
+    // The main event!
+    generate_gifs(&config, table, &walk, out_height, num_dims, dims, gif_fds);
 
-    uint32_t level_index = 0;
-    for (uint32_t chr_index = 0; chr_index < level_len; chr_index++) {
-        if (!isspace(level_string[chr_index])) {
-            level[level_index] = level_string[chr_index];
-            level_index++;
+    if (NULL != checkpoints) {
+        if (!checkpoints_save(checkpoints, checkpoint_file)) {
+            fprintf(stderr, "Could not write '%s'!\n", checkpoint_file);
         }
+        checkpoints_destroy(&checkpoints);
     }
-    
-    return level;
+
+    // Clean Up
+    table_destroy(&table);
+
+    return 0;
 }
 
-char *read_file(char *file_name) {
-    FILE *file = fopen(file_name, "r");
+// train a table on the given level file, or the test level if there is none.
+// a binary built with a model compiled in uses that instead of the test level.
+// unless max_copy is 0, the table indexes the level so walks copy at most
+// max_copy rows of it in a row. a long level is trained on up to num_threads
+// threads.
+Table *load_table(char *file_name, uint32_t flags, uint32_t max_copy, uint32_t num_threads) {
+#ifdef EMBEDDED_MODEL
+    if (NULL == file_name) {
+        return table_embedded();
+    }
+#endif
+
+    char *level = NULL;
+    uint32_t level_width = 0;
+    uint32_t level_height = 0;
 
-    if (NULL == file) {
-        fprintf(stderr, "Could not open '%s'!\n", file_name);
+    if (NULL == file_name) {
+        level = parse_level(gv_test_level, &level_width, &level_height);
+    } else {
+        char *level_string = read_file(file_name);
+        level = parse_level(level_string, &level_width, &level_height);
+        free(level_string);
+    }
+    if (NULL == level) {
         exit(0);
     }
 
-    // get file size
-    int retval = 0;
-    retval = fseek(file, 0, SEEK_END);
-    assert(0 == retval);
+    // cells are packed into one 64 bit word per row
+    uint32_t cell_bits = bitmap_cell_bits(level_width, level_height, level);
+    if ((level_width * cell_bits) > 64)
+    {
+        printf("Level width must be at most %d for %d tile types (was %d)!\n",
+               64 / cell_bits, 1 << cell_bits, level_width);
+        exit(0);
+    }
 
-    int file_size = ftell(file);
-    assert(file_size > 0);
+    Table *table = table_create_empty(level_width, cell_bits, flags);
+    if (max_copy > 0) {
+        table->novelty = novelty_create(max_copy);
+    }
 
-    retval = fseek(file, 0, SEEK_SET);
-    assert(0 == retval);
+    bool trained = table_train_threads(table, level_height, level, num_threads);
+    assert(trained);
 
-    // allocate space for file data
-    char *file_data = (char*)calloc(1, file_size + 1);
-    assert(NULL != file_data);
+    free(level);
 
-    // read in full file
-    int read_result = fread(file_data, 1, file_size, file);
-    assert(read_result == file_size);
+    return table;
+}
 
-    file_data[file_size - 1] = '\0';
+// merge similar rows and drop rare transitions, if asked to, replacing the
+// table with the smaller one
+Table *compact_model(Table *table, int merge_distance, int prune_count) {
+    if ((merge_distance <= 0) && (prune_count <= 1)) {
+        return table;
+    }
 
-    return file_data;
-}
+    Table *compacted = compact_table(table, merge_distance > 0 ? merge_distance : 0, prune_count > 1 ? prune_count : 1);
 
-void emit_frame(ge_GIF *gif, int speed, uint32_t dim, Image *image) {
-    for (uint32_t y = 0; y < image->height; y++) {
-        for (uint32_t x = 0; x < image->width; x++) {
-            uint32_t index = x + y * image->width;
+    uint64_t num_transitions = 0;
+    uint64_t num_compacted = 0;
+    for (uint32_t row_index = 0; row_index < table->num_rows; row_index++) {
+        num_transitions += table->rows[row_index].num_transitions;
+    }
+    for (uint32_t row_index = 0; row_index < compacted->num_rows; row_index++) {
+        num_compacted += compacted->rows[row_index].num_transitions;
+    }
+    fprintf(stderr, "Compacted %u rows with %llu transitions to %u rows with %llu transitions\n",
+            table->num_rows, (unsigned long long)num_transitions,
+            compacted->num_rows, (unsigned long long)num_compacted);
 
-            uint32_t y_offset = y * dim;
-            uint32_t x_offset = x * dim;
+    table_destroy(&table);
 
-            uint8_t color = image->data[index];
-            for (uint32_t w = 0; w < dim; w++) {
-                for (uint32_t h = 0; h < dim; h++) {
+    return compacted;
+}
 
-                    uint32_t pixel_index =
-                        x_offset + w + (dim * image->width) * (y_offset + h);
+// read a comma separated list of gif sizes, returning how many there are,
+// or 0 if the list is not valid
+uint32_t parse_dims(char const *dim_option, int *dims) {
+    uint32_t num_dims = 0;
+    char const *position = dim_option;
+
+    while (true) {
+        char *end = NULL;
+        long dim = strtol(position, &end, 10);
+        if ((end == position) || (dim <= 0) || (num_dims == MAX_DIMS)) {
+            return 0;
+        }
+        dims[num_dims++] = dim;
 
-                    gif->frame[pixel_index] = color;
-                }
-            }
+        if (*end == '\0') {
+            return num_dims;
+        } else if (*end != ',') {
+            return 0;
         }
+        position = end + 1;
     }
+}
 
-    ge_add_frame(gif, speed);
+// load a model saved with --save
+Table *load_model(char *model_file) {
+    Table *table = table_load(model_file);
+    if (NULL == table) {
+        fprintf(stderr, "Could not read a model from '%s'!\n", model_file);
+        exit(0);
+    }
 
+    return table;
 }
 
-void scroll(Image *image) {
-    for (uint32_t y = 0; y < (image->height - 1); y++) {
-        for (uint32_t x = 0; x < image->width; x++) {
-            uint32_t index = x + y * image->width;
+// generate many levels at once, advancing all of their walks together, and
+// print them to stdout separated by empty lines
+void generate_pool(Table *table, uint32_t num_levels, uint32_t num_rows, uint64_t seed) {
+    uint32_t *rows = (uint32_t*)malloc((uint64_t)num_levels * num_rows * sizeof(uint32_t));
+    assert(NULL != rows);
 
-            image->data[index] = image->data[x + (y + 1) * image->width];
-        }
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    table_read_lock(table);
+
+    Batch *batch = batch_create(table, num_levels, seed);
+    for (uint32_t row_index = 0; row_index < num_rows; row_index++) {
+        batch_step(batch, &rows[(uint64_t)row_index * num_levels]);
     }
+    batch_destroy(&batch);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
 
-    for (uint32_t x = 0; x < image->width; x++) {
-        uint32_t index = x + (image->height - 1) * image->width;
-        image->data[index] = 0;
+    char *line = (char*)malloc(table->row_width + 2);
+    assert(NULL != line);
+    line[table->row_width] = '\n';
+    line[table->row_width + 1] = '\0';
+
+    for (uint32_t level_index = 0; level_index < num_levels; level_index++) {
+        if (level_index > 0) {
+            printf("\n");
+        }
+        for (uint32_t row_index = 0; row_index < num_rows; row_index++) {
+            table_row_string(table, rows[(uint64_t)row_index * num_levels + level_index], line);
+            fputs(line, stdout);
+        }
     }
+
+    table_read_unlock(table);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "Generated %llu rows in %.3f ms (%.1f million rows per second)\n",
+            (unsigned long long)num_levels * num_rows, seconds * 1e3,
+            (double)num_levels * num_rows / seconds / 1e6);
+
+    free(line);
+    free(rows);
 }
 
-Image *image_create(uint32_t width, uint32_t height) {
-    Image *image = (Image*)calloc(1, sizeof(Image));
+// generate levels that start with the row from_string and end with the row
+// to_string, either of which may be NULL to leave that end free
+void generate_bridges(Table *table, uint32_t num_levels, uint32_t num_rows, uint64_t seed,
+                      char const *from_string, char const *to_string) {
+    table_read_lock(table);
+
+    uint32_t from_row = INVALID_ROW;
+    uint32_t to_row = INVALID_ROW;
+    char const *missing = NULL;
+    if (NULL != from_string) {
+        from_row = table_find_row(table, from_string);
+        missing = INVALID_ROW == from_row ? from_string : missing;
+    }
+    if (NULL != to_string) {
+        to_row = table_find_row(table, to_string);
+        missing = INVALID_ROW == to_row ? to_string : missing;
+    }
+    if (NULL != missing) {
+        fprintf(stderr, "The row '%s' does not appear in the level!\n", missing);
+        table_read_unlock(table);
+        return;
+    }
+
+    Bridge *bridge = bridge_create(table, from_row, to_row, num_rows);
+    if (NULL == bridge) {
+        fprintf(stderr, "No level of %d rows joins these rows!\n", num_rows);
+        table_read_unlock(table);
+        return;
+    }
 
-    image->width = width;
-    image->height = height;
+    uint32_t *rows = (uint32_t*)malloc(num_rows * sizeof(uint32_t));
+    char *line = (char*)malloc(table->row_width + 2);
+    assert((NULL != rows) && (NULL != line));
+    line[table->row_width] = '\n';
+    line[table->row_width + 1] = '\0';
 
-    image->data = (uint8_t*)calloc(1, width * height * sizeof(uint8_t));
+    Rng rng;
+    rng_seed(&rng, seed);
 
-    return image;
-}
+    for (uint32_t level_index = 0; level_index < num_levels; level_index++) {
+        if (level_index > 0) {
+            printf("\n");
+        }
 
-void image_destroy(Image **image) {
-    free((*image)->data);
-    free(*image);
-    *image = NULL;
+        bridge_sample(bridge, table, &rng, rows);
+        for (uint32_t row_index = 0; row_index < num_rows; row_index++) {
+            table_row_string(table, rows[row_index], line);
+            fputs(line, stdout);
+        }
+    }
+
+    bridge_destroy(&bridge);
+    table_read_unlock(table);
+
+    free(line);
+    free(rows);
 }
 
+void print_usage(void) {
+    printf("Usage: downgen [OPTION]...\n");
+    printf("       downgen --serve SOCKET [OPTION]... [FILE]...\n");
+    printf("       downgen --connect SOCKET REQUEST...\n");
+    printf("  Create a gif of a vertically scrolling level from a given input level\n");
+    printf("\n");
+    printf("  --file, -f FILE    Use the given file as the input.\n");
+    printf("                     The file should contain 0's and 1's, one column per\n");
+    printf("                     line, with the same number of characters in each line.\n");
+    printf("                     Other tile types are the digits 2-9 and letters A-F\n");
+    printf("  --dim,-d  N        Set the GIF dimensions (width and height in pixels of each block.\n");
+    printf("                     For example, 5 makes each cell in the output a 5x5 pixel block\n");
+    printf("                     Several sizes separated by commas, such as 4,8,20, write the\n");
+    printf("                     same level to level_N.gif for each size N at once\n");
+    printf("                     Defaults to %d.\n", DEFAULT_DIM);
+    printf("  --height,-h N      Set the number of rows in the output image\n");
+    printf("                     Defaults to %d\n", DEFAULT_OUT_HEIGHT);
+    printf("  --speed,-s N       Set the speed of the gif- 1 means 10ms per frame\n");
+    printf("                     Defaults to %d\n", DEFAULT_SPEED);
+    printf("  --clear MODE       When to start a new LZW dictionary once one fills up.\n");
+    printf("                     'full' starts one straight away, and 'ratio' keeps the\n");
+    printf("                     full one until it compresses worse, which gives smaller\n");
+    printf("                     gifs of scaled up blocks. Defaults to ratio\n");
+    printf("  --print,-p         Print out a summary of the transition table- its\n");
+    printf("                     dead ends, components, entropy and most visited rows.\n");
+    printf("                     Small tables are also printed in full\n");
+    printf("  --mirror,-m        Treat rows that are mirror images of each other as the\n");
+    printf("                     same row when training, giving a smaller table\n");
+    printf("  --save FILE        Save the trained transition table to FILE\n");
+    printf("  --model FILE       Use a transition table saved with --save instead of\n");
+    printf("                     training on a level\n");
+    printf("  --source FILE      Write the trained transition table to FILE as C source\n");
+    printf("                     and exit, to be built in with 'make downgen-embedded'\n");
+    printf("  --external,-x      Train on the --file level without reading it all into\n");
+    printf("                     memory, spilling to temporary files, and save the table\n");
+    printf("                     to the --save FILE. For levels too big to fit in memory\n");
+    printf("  --memory N         Set the memory in megabytes used by --external training\n");
+    printf("                     Defaults to %d\n", DEFAULT_MEMORY_MB);
+    printf("  --copy N           Keep generated levels from copying more than N rows in a\n");
+    printf("                     row from the input level, where the table allows. 0 turns\n");
+    printf("                     this off. Saved, built in and compacted tables do not keep\n");
+    printf("                     the level, so this only applies when training. Defaults to %d\n", DEFAULT_MAX_COPY);
+    printf("  --merge N          Merge rows that differ in at most N cells into the most\n");
+    printf("                     common of them, for a smaller table\n");
+    printf("  --prune N          Drop transitions seen fewer than N times, keeping a way\n");
+    printf("                     out of every row. Both of these apply before --save\n");
+    printf("  --json,-j FILE     Write the transition table analysis, with the details\n");
+    printf("                     of every row, to FILE as JSON\n");
+    printf("  --threads,-t N     Set the number of threads used for training and analysis\n");
+    printf("                     Defaults to the number of processors\n");
+    printf("  --pool N           Instead of a gif, print N levels to stdout, separated by\n");
+    printf("                     empty lines. All N levels are generated together\n");
+    printf("  --rows,-r N        Set the number of rows in each level of the pool\n");
+    printf("                     Defaults to %d\n", DEFAULT_OUT_HEIGHT);
+    printf("  --from ROW         Instead of a gif, print levels that start with ROW, such as\n");
+    printf("                     100000001, which must appear in the input level\n");
+    printf("  --to ROW           Instead of a gif, print levels that end with ROW. With\n");
+    printf("                     --from, this joins two rows with a level of --rows rows.\n");
+    printf("                     --pool sets the number of levels\n");
+    printf("  --seed N           Set the random seed, so the same level can be made again\n");
+    printf("                     Defaults to the current time\n");
+    printf("  --start N          Start the gif at row N of the level\n");
+    printf("  --checkpoints,-c FILE\n");
+    printf("                     Record the state of the level every so many rows in FILE,\n");
+    printf("                     and use an existing FILE to find the --start row quickly.\n");
+    printf("                     The seed is taken from FILE unless --seed is given\n");
+    printf("  --interval,-i N    Set the number of rows between checkpoints\n");
+    printf("                     Defaults to %d\n", DEFAULT_CHECKPOINT_INTERVAL);
+    printf("  --serve SOCKET     Train a model for each FILE (or the input level, named\n");
+    printf("                     'default') and serve them on a unix socket. Requests are\n");
+    printf("                     'rows MODEL N SEED [START]', 'gif MODEL N SEED [START]'\n");
+    printf("                     and 'train MODEL'\n");
+    printf("  --workers,-w N     Set the number of threads serving requests\n");
+    printf("                     Defaults to %d\n", DEFAULT_WORKERS);
+    printf("  --connect SOCKET   Send a request to a server and print the response.\n");
+    printf("                     For 'train' the level is read from stdin\n");
+    printf("  --help             Print this help message\n");
+    printf("\n");
+}
@@ -0,0 +1,231 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+#include "rng.h"
+
+#include "novelty.h"
+
+
+#define NO_STATE 0xFFFFFFFF
+#define NO_EDGE 0xFFFFFFFF
+
+#define INITIAL_STATES 1024
+
+
+static uint32_t find_edge(Novelty *novelty, uint32_t state, uint32_t row);
+static void set_edge(Novelty *novelty, uint32_t state, uint32_t row, uint32_t target);
+static void insert_edge(Novelty *novelty, uint32_t edge_index);
+static uint32_t add_state(Novelty *novelty, uint32_t length, uint32_t link);
+static uint32_t extend(Novelty *novelty, uint32_t last, uint32_t row);
+
+
+Novelty *novelty_create(uint32_t max_copy) {
+    Novelty *novelty = (Novelty*)calloc(1, sizeof(Novelty));
+    assert(NULL != novelty);
+
+    novelty->max_copy = max_copy;
+
+    novelty->states_capacity = INITIAL_STATES;
+    novelty->states = (NoveltyState*)malloc(novelty->states_capacity * sizeof(NoveltyState));
+    assert(NULL != novelty->states);
+
+    novelty->edges_capacity = INITIAL_STATES;
+    novelty->edges = (NoveltyEdge*)malloc(novelty->edges_capacity * sizeof(NoveltyEdge));
+    assert(NULL != novelty->edges);
+
+    novelty->lookup_capacity = 2 * INITIAL_STATES;
+    novelty->lookup = (uint32_t*)malloc(novelty->lookup_capacity * sizeof(uint32_t));
+    assert(NULL != novelty->lookup);
+    memset(novelty->lookup, 0xFF, novelty->lookup_capacity * sizeof(uint32_t));
+
+    // the root stands for the empty run
+    add_state(novelty, 0, NO_STATE);
+
+    return novelty;
+}
+
+void novelty_destroy(Novelty **novelty) {
+    free((*novelty)->states);
+    free((*novelty)->edges);
+    free((*novelty)->lookup);
+    free(*novelty);
+    *novelty = NULL;
+}
+
+static uint32_t find_edge(Novelty *novelty, uint32_t state, uint32_t row) {
+    uint32_t slot = rng_mix(((uint64_t)state << 32) | row) & (novelty->lookup_capacity - 1);
+
+    while (novelty->lookup[slot] != NO_EDGE) {
+        NoveltyEdge *edge = &novelty->edges[novelty->lookup[slot]];
+        if ((edge->source == state) && (edge->row == row)) {
+            return novelty->lookup[slot];
+        }
+        slot = (slot + 1) & (novelty->lookup_capacity - 1);
+    }
+
+    return NO_EDGE;
+}
+
+static void insert_edge(Novelty *novelty, uint32_t edge_index) {
+    NoveltyEdge *edge = &novelty->edges[edge_index];
+    uint32_t slot = rng_mix(((uint64_t)edge->source << 32) | edge->row) & (novelty->lookup_capacity - 1);
+
+    while (novelty->lookup[slot] != NO_EDGE) {
+        slot = (slot + 1) & (novelty->lookup_capacity - 1);
+    }
+    novelty->lookup[slot] = edge_index;
+}
+
+static void set_edge(Novelty *novelty, uint32_t state, uint32_t row, uint32_t target) {
+    uint32_t edge_index = find_edge(novelty, state, row);
+    if (NO_EDGE != edge_index) {
+        novelty->edges[edge_index].target = target;
+        return;
+    }
+
+    if (novelty->num_edges == novelty->edges_capacity) {
+        novelty->edges_capacity *= 2;
+        novelty->edges = (NoveltyEdge*)realloc(novelty->edges, novelty->edges_capacity * sizeof(NoveltyEdge));
+        assert(NULL != novelty->edges);
+    }
+
+    // keep the hash at most half full
+    if ((novelty->num_edges + 1) * 2 > novelty->lookup_capacity) {
+        novelty->lookup_capacity *= 2;
+        novelty->lookup = (uint32_t*)realloc(novelty->lookup, novelty->lookup_capacity * sizeof(uint32_t));
+        assert(NULL != novelty->lookup);
+        memset(novelty->lookup, 0xFF, novelty->lookup_capacity * sizeof(uint32_t));
+
+        for (uint32_t index = 0; index < novelty->num_edges; index++) {
+            insert_edge(novelty, index);
+        }
+    }
+
+    edge_index = novelty->num_edges++;
+    NoveltyEdge *edge = &novelty->edges[edge_index];
+    edge->source = state;
+    edge->row = row;
+    edge->target = target;
+    edge->next_edge = novelty->states[state].first_edge;
+    novelty->states[state].first_edge = edge_index;
+
+    insert_edge(novelty, edge_index);
+}
+
+static uint32_t add_state(Novelty *novelty, uint32_t length, uint32_t link) {
+    if (novelty->num_states == novelty->states_capacity) {
+        novelty->states_capacity *= 2;
+        novelty->states = (NoveltyState*)realloc(novelty->states, novelty->states_capacity * sizeof(NoveltyState));
+        assert(NULL != novelty->states);
+    }
+
+    uint32_t state = novelty->num_states++;
+    novelty->states[state].length = length;
+    novelty->states[state].link = link;
+    novelty->states[state].first_edge = NO_EDGE;
+
+    return state;
+}
+
+// split the runs of longer than length rows off of a state, which becomes
+// their own state, leaving the state for the runs up to length rows
+static uint32_t split_state(Novelty *novelty, uint32_t parent, uint32_t state, uint32_t row) {
+    uint32_t clone = add_state(novelty, novelty->states[parent].length + 1, novelty->states[state].link);
+    for (uint32_t edge = novelty->states[state].first_edge; edge != NO_EDGE; edge = novelty->edges[edge].next_edge) {
+        set_edge(novelty, clone, novelty->edges[edge].row, novelty->edges[edge].target);
+    }
+
+    novelty->states[state].link = clone;
+    for (uint32_t from = parent; from != NO_STATE; from = novelty->states[from].link) {
+        uint32_t edge = find_edge(novelty, from, row);
+        if ((NO_EDGE == edge) || (novelty->edges[edge].target != state)) {
+            break;
+        }
+        novelty->edges[edge].target = clone;
+    }
+
+    return clone;
+}
+
+// the usual online construction, extended to more than one level. a run
+// can already be known when it is added, from an earlier level.
+static uint32_t extend(Novelty *novelty, uint32_t last, uint32_t row) {
+    uint32_t edge = find_edge(novelty, last, row);
+    if (NO_EDGE != edge) {
+        uint32_t next = novelty->edges[edge].target;
+        if (novelty->states[next].length == novelty->states[last].length + 1) {
+            return next;
+        }
+        return split_state(novelty, last, next, row);
+    }
+
+    uint32_t current = add_state(novelty, novelty->states[last].length + 1, 0);
+
+    uint32_t from = last;
+    while ((from != NO_STATE) && (NO_EDGE == find_edge(novelty, from, row))) {
+        set_edge(novelty, from, row, current);
+        from = novelty->states[from].link;
+    }
+
+    if (from != NO_STATE) {
+        uint32_t next = novelty->edges[find_edge(novelty, from, row)].target;
+        // splitting can move the states, so it is done before the store
+        uint32_t link = next;
+        if (novelty->states[next].length != novelty->states[from].length + 1) {
+            link = split_state(novelty, from, next, row);
+        }
+        novelty->states[current].link = link;
+    }
+
+    return current;
+}
+
+void novelty_add(Novelty *novelty, uint32_t const *rows, uint32_t num_rows) {
+    uint32_t wrapped = novelty->max_copy < num_rows ? novelty->max_copy : num_rows;
+
+    uint32_t last = 0;
+    for (uint32_t index = 0; index < num_rows + wrapped; index++) {
+        last = extend(novelty, last, rows[index % num_rows]);
+    }
+}
+
+void novelty_start(NoveltyMatch *match) {
+    match->state = 0;
+    match->length = 0;
+}
+
+// follow the row from the matched rows, dropping the oldest of them until
+// the run with the row added is one that appears in a trained level. runs
+// longer than max_copy are cut down to it, which is all novelty_allows()
+// needs.
+void novelty_advance(Novelty *novelty, NoveltyMatch *match, uint32_t row) {
+    uint32_t edge = find_edge(novelty, match->state, row);
+    while ((NO_EDGE == edge) && (match->state != 0)) {
+        match->state = novelty->states[match->state].link;
+        match->length = novelty->states[match->state].length;
+        edge = find_edge(novelty, match->state, row);
+    }
+
+    if (NO_EDGE == edge) {
+        match->length = 0;
+        return;
+    }
+
+    match->state = novelty->edges[edge].target;
+    match->length++;
+
+    if (match->length > novelty->max_copy) {
+        match->length = novelty->max_copy;
+        while (novelty->states[novelty->states[match->state].link].length >= match->length) {
+            match->state = novelty->states[match->state].link;
+        }
+    }
+}
+
+bool novelty_allows(Novelty *novelty, NoveltyMatch *match, uint32_t row) {
+    return (match->length < novelty->max_copy) || (NO_EDGE == find_edge(novelty, match->state, row));
+}
@@ -0,0 +1,66 @@
+#ifndef DOWNGEN_NOVELTY
+#define DOWNGEN_NOVELTY
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+#define DEFAULT_MAX_COPY 16
+
+
+typedef struct NoveltyState {
+    // the longest run of rows this state stands for
+    uint32_t length;
+    uint32_t link;
+    uint32_t first_edge;
+} NoveltyState;
+
+typedef struct NoveltyEdge {
+    uint32_t source;
+    uint32_t row;
+    uint32_t target;
+    uint32_t next_edge;
+} NoveltyEdge;
+
+// a suffix automaton over the rows of every level trained on, recognising
+// every run of rows that appears in them, so a walk can tell how many rows
+// it has copied from a trained level
+typedef struct Novelty {
+    uint32_t max_copy;
+
+    uint32_t num_states;
+    uint32_t states_capacity;
+    NoveltyState *states;
+
+    uint32_t num_edges;
+    uint32_t edges_capacity;
+    NoveltyEdge *edges;
+
+    // open addressed hash from a state and a row to the edge between them
+    uint32_t lookup_capacity;
+    uint32_t *lookup;
+} Novelty;
+
+// the longest run of a walk's last rows that appears in a trained level,
+// capped at max_copy rows
+typedef struct NoveltyMatch {
+    uint32_t state;
+    uint32_t length;
+} NoveltyMatch;
+
+
+Novelty *novelty_create(uint32_t max_copy);
+void novelty_destroy(Novelty **novelty);
+
+// add the row indices of a level. levels wrap around, so runs that go past
+// the end and back to the start are included.
+void novelty_add(Novelty *novelty, uint32_t const *rows, uint32_t num_rows);
+
+void novelty_start(NoveltyMatch *match);
+void novelty_advance(Novelty *novelty, NoveltyMatch *match, uint32_t row);
+
+// whether row can follow the matched rows without copying more than
+// max_copy rows of a trained level. this is one hash lookup.
+bool novelty_allows(Novelty *novelty, NoveltyMatch *match, uint32_t row);
+
+#endif
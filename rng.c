@@ -0,0 +1,15 @@
+#include <stdint.h>
+
+#include "rng.h"
+
+
+void rng_seed(Rng *rng, uint64_t seed) {
+    rng->state = seed;
+}
+
+// splitmix64, keeping the upper half of the output
+uint32_t rng_next(Rng *rng) {
+    rng->state += RNG_INCREMENT;
+
+    return (uint32_t)(rng_mix(rng->state) >> 32);
+}
@@ -0,0 +1,28 @@
+#ifndef DOWNGEN_RNG
+#define DOWNGEN_RNG
+
+#include <stdint.h>
+
+
+// a small random number generator whose whole state is one word, so that
+// each generator can be seeded independently and its state saved.
+typedef struct Rng {
+    uint64_t state;
+} Rng;
+
+
+#define RNG_INCREMENT 0x9E3779B97F4A7C15ULL
+
+// the splitmix64 output function, shared with the batched generator so
+// each of its lanes produces the same numbers as an Rng
+static inline uint64_t rng_mix(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+
+void rng_seed(Rng *rng, uint64_t seed);
+uint32_t rng_next(Rng *rng);
+
+#endif
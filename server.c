@@ -0,0 +1,518 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "generate.h"
+#include "level.h"
+#include "table.h"
+#include "walk.h"
+
+#include "server.h"
+
+
+#define MAX_REQUEST 256
+
+// limits on one request. seeking and generating hold the model's read lock,
+// and seeking its checkpoint mutex, so one request can not hold up training
+// and other clients' seeks for long.
+#define MAX_START_ROW (1ULL << 24)
+#define MAX_ROWS (1 << 20)
+#define MAX_FRAMES 10000
+#define MAX_TRAIN_BYTES (64 << 20)
+#define QUEUE_SIZE 64
+#define ROW_CHUNK 4096
+
+// seconds a client may take to send or read any part of a request before
+// the worker gives up on it
+#define CLIENT_TIMEOUT 30
+
+
+typedef struct Server {
+    Config *config;
+    uint32_t out_height;
+    Model *models;
+    uint32_t num_models;
+
+    // connections waiting for a worker
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    int queue[QUEUE_SIZE];
+    uint32_t queue_start;
+    uint32_t queue_count;
+} Server;
+
+
+static void *worker(void *arg);
+static void handle_client(Server *server, int fd);
+static void start_walk(Model *model, uint64_t seed, uint64_t start_row, Walk *walk);
+static void write_rows(Table *table, Walk *walk, uint32_t num_rows, FILE *response);
+static void send_response(FILE *response, int fd);
+static void train_model(Table *table, char *body, uint32_t body_len, int fd);
+static Model *find_model(Server *server, char const *name);
+static bool write_all(int fd, char const *data, size_t len);
+static void write_error(int fd, char const *message);
+
+
+void server_run(char const *socket_path, Config *config, uint32_t out_height,
+                Model *models, uint32_t num_models, uint32_t num_workers) {
+    assert(num_workers > 0);
+
+    Server server;
+    memset(&server, 0, sizeof(server));
+    server.config = config;
+    server.out_height = out_height;
+    server.models = models;
+    server.num_models = num_models;
+    pthread_mutex_init(&server.mutex, NULL);
+    pthread_cond_init(&server.not_empty, NULL);
+    pthread_cond_init(&server.not_full, NULL);
+
+    for (uint32_t model_index = 0; model_index < num_models; model_index++) {
+        pthread_mutex_init(&models[model_index].checkpoint_mutex, NULL);
+        memset(models[model_index].checkpoints, 0, sizeof(models[model_index].checkpoints));
+        models[model_index].next_checkpoints = 0;
+    }
+
+    // clients going away should not take the server with them
+    signal(SIGPIPE, SIG_IGN);
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path '%s' is too long!\n", socket_path);
+        exit(0);
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(listen_fd >= 0);
+
+    unlink(socket_path);
+    if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "Could not bind '%s'!\n", socket_path);
+        exit(0);
+    }
+
+    int retval = listen(listen_fd, SOMAXCONN);
+    assert(0 == retval);
+
+    pthread_t *workers = (pthread_t*)calloc(num_workers, sizeof(pthread_t));
+    assert(NULL != workers);
+    for (uint32_t worker_index = 0; worker_index < num_workers; worker_index++) {
+        retval = pthread_create(&workers[worker_index], NULL, worker, &server);
+        assert(0 == retval);
+    }
+
+    fprintf(stderr, "Serving %d model(s) on '%s'\n", num_models, socket_path);
+
+    while (true) {
+        int client_fd = accept(listen_fd, NULL, NULL);
+        if (client_fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "accept failed: %s\n", strerror(errno));
+            break;
+        }
+
+        // a client that stops sending or reading does not keep a worker
+        struct timeval timeout = {CLIENT_TIMEOUT, 0};
+        setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        pthread_mutex_lock(&server.mutex);
+        while (server.queue_count == QUEUE_SIZE) {
+            pthread_cond_wait(&server.not_full, &server.mutex);
+        }
+        server.queue[(server.queue_start + server.queue_count) % QUEUE_SIZE] = client_fd;
+        server.queue_count++;
+        pthread_cond_signal(&server.not_empty);
+        pthread_mutex_unlock(&server.mutex);
+    }
+
+    close(listen_fd);
+    unlink(socket_path);
+
+    for (uint32_t model_index = 0; model_index < num_models; model_index++) {
+        for (uint32_t cache_index = 0; cache_index < CHECKPOINT_CACHE; cache_index++) {
+            if (NULL != models[model_index].checkpoints[cache_index]) {
+                checkpoints_destroy(&models[model_index].checkpoints[cache_index]);
+            }
+        }
+        pthread_mutex_destroy(&models[model_index].checkpoint_mutex);
+    }
+}
+
+static void *worker(void *arg) {
+    Server *server = (Server*)arg;
+
+    while (true) {
+        pthread_mutex_lock(&server->mutex);
+        while (server->queue_count == 0) {
+            pthread_cond_wait(&server->not_empty, &server->mutex);
+        }
+        int fd = server->queue[server->queue_start];
+        server->queue_start = (server->queue_start + 1) % QUEUE_SIZE;
+        server->queue_count--;
+        pthread_cond_signal(&server->not_full);
+        pthread_mutex_unlock(&server->mutex);
+
+        handle_client(server, fd);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+static void handle_client(Server *server, int fd) {
+    char request[MAX_REQUEST + 1];
+    uint32_t request_len = 0;
+    char *newline = NULL;
+
+    // read up to the end of the request line. anything after it is the
+    // start of the request body.
+    while (NULL == newline) {
+        if (request_len == MAX_REQUEST) {
+            write_error(fd, "request line too long");
+            return;
+        }
+
+        ssize_t amount = read(fd, &request[request_len], MAX_REQUEST - request_len);
+        if (amount <= 0) {
+            break;
+        }
+        request_len += amount;
+        request[request_len] = '\0';
+        newline = memchr(request, '\n', request_len);
+    }
+    request[request_len] = '\0';
+
+    uint32_t line_len = request_len;
+    if (NULL != newline) {
+        *newline = '\0';
+        line_len = newline - request;
+    }
+
+    char command[16];
+    char model_name[MAX_REQUEST];
+    uint32_t count = 0;
+    uint64_t seed = 0;
+    uint64_t start_row = 0;
+    int num_fields = sscanf(request, "%15s %255s %" SCNu32 " %" SCNu64 " %" SCNu64,
+                            command, model_name, &count, &seed, &start_row);
+    if (num_fields < 2) {
+        write_error(fd, "expected 'COMMAND MODEL ...'");
+        return;
+    }
+
+    Model *model = find_model(server, model_name);
+    if (NULL == model) {
+        write_error(fd, "unknown model");
+        return;
+    }
+
+    if (start_row > MAX_START_ROW) {
+        write_error(fd, "START is too large");
+        return;
+    }
+
+    // rows and gifs are written to a temporary file while the model is
+    // locked and sent once it is unlocked, so a client that stops reading
+    // does not hold up training
+    FILE *response = NULL;
+    if ((0 == strcmp(command, "rows")) || (0 == strcmp(command, "gif"))) {
+        response = tmpfile();
+        if (NULL == response) {
+            write_error(fd, "could not buffer the response");
+            return;
+        }
+    }
+
+    if (0 == strcmp(command, "rows")) {
+        if (num_fields < 4) {
+            write_error(fd, "expected 'rows MODEL N SEED [START]'");
+        } else if (count > MAX_ROWS) {
+            write_error(fd, "too many rows");
+        } else {
+            Walk walk;
+            table_read_lock(model->table);
+            start_walk(model, seed, start_row, &walk);
+            write_rows(model->table, &walk, count, response);
+            table_read_unlock(model->table);
+
+            send_response(response, fd);
+        }
+        fclose(response);
+    } else if (0 == strcmp(command, "gif")) {
+        if (num_fields < 4) {
+            write_error(fd, "expected 'gif MODEL N SEED [START]'");
+        } else if (count > MAX_FRAMES) {
+            write_error(fd, "too many frames");
+        } else {
+            Config config = *server->config;
+            config.num_frames = count;
+
+            // the GIF closes its descriptor, and the file keeps its own
+            int gif_fd = dup(fileno(response));
+            assert(gif_fd >= 0);
+
+            Walk walk;
+            table_read_lock(model->table);
+            start_walk(model, seed, start_row, &walk);
+            generate_gif(&config, model->table, &walk, server->out_height, gif_fd);
+            table_read_unlock(model->table);
+
+            send_response(response, fd);
+        }
+        fclose(response);
+    } else if (0 == strcmp(command, "train")) {
+        // the body is whatever followed the request line
+        uint32_t body_len = 0;
+        if (line_len < request_len) {
+            body_len = request_len - line_len - 1;
+        }
+        uint32_t body_capacity = MAX_REQUEST + body_len;
+        char *body = (char*)malloc(body_capacity + 1);
+        if (NULL == body) {
+            write_error(fd, "out of memory");
+            return;
+        }
+        memcpy(body, &request[line_len + 1], body_len);
+
+        // one byte past the limit is read, to tell a level of exactly
+        // MAX_TRAIN_BYTES from a longer one
+        while (body_len <= MAX_TRAIN_BYTES) {
+            if (body_len == body_capacity) {
+                body_capacity = body_capacity * 2 > MAX_TRAIN_BYTES ? MAX_TRAIN_BYTES + 1 : body_capacity * 2;
+                char *grown = (char*)realloc(body, body_capacity + 1);
+                if (NULL == grown) {
+                    write_error(fd, "out of memory");
+                    free(body);
+                    return;
+                }
+                body = grown;
+            }
+
+            ssize_t amount = read(fd, &body[body_len], body_capacity - body_len);
+            if (amount <= 0) {
+                break;
+            }
+            body_len += amount;
+        }
+        body[body_len] = '\0';
+
+        if (body_len > MAX_TRAIN_BYTES) {
+            write_error(fd, "level is too large");
+            free(body);
+            return;
+        }
+
+        train_model(model->table, body, body_len, fd);
+        free(body);
+    } else {
+        write_error(fd, "unknown command");
+    }
+}
+
+// start a walk with the given seed at the given row. long walks are found
+// from the model's cached checkpoints for that seed, which are extended as
+// clients seek further in. the caller holds the table's read lock.
+static void start_walk(Model *model, uint64_t seed, uint64_t start_row, Walk *walk) {
+    Table *table = model->table;
+
+    walk_start(walk, table, seed);
+    if (start_row == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&model->checkpoint_mutex);
+
+    Checkpoints *checkpoints = NULL;
+    for (uint32_t cache_index = 0; cache_index < CHECKPOINT_CACHE; cache_index++) {
+        Checkpoints *cached = model->checkpoints[cache_index];
+        if ((NULL != cached) && (cached->seed == seed) && checkpoints_match(cached, table)) {
+            checkpoints = cached;
+            break;
+        }
+    }
+
+    // replace the oldest entry
+    if (NULL == checkpoints) {
+        uint32_t cache_index = model->next_checkpoints;
+        model->next_checkpoints = (model->next_checkpoints + 1) % CHECKPOINT_CACHE;
+
+        if (NULL != model->checkpoints[cache_index]) {
+            checkpoints_destroy(&model->checkpoints[cache_index]);
+        }
+        model->checkpoints[cache_index] = checkpoints_create(table, seed, DEFAULT_CHECKPOINT_INTERVAL);
+        checkpoints = model->checkpoints[cache_index];
+    }
+
+    bool found = walk_seek(walk, table, checkpoints, start_row);
+    assert(found);
+
+    pthread_mutex_unlock(&model->checkpoint_mutex);
+}
+
+static void write_rows(Table *table, Walk *walk, uint32_t num_rows, FILE *response) {
+    char *line = (char*)malloc(table->row_width + 1);
+    assert(NULL != line);
+    line[table->row_width] = '\n';
+
+    for (uint32_t row_index = 0; row_index < num_rows; row_index++) {
+        table_row_string(table, walk_next(walk, table), line);
+        fwrite(line, 1, table->row_width + 1, response);
+    }
+
+    free(line);
+}
+
+// send everything written to the response, from the start
+static void send_response(FILE *response, int fd) {
+    fflush(response);
+    rewind(response);
+
+    char buffer[ROW_CHUNK];
+    size_t amount = 0;
+    while ((amount = fread(buffer, 1, sizeof(buffer), response)) > 0) {
+        if (!write_all(fd, buffer, amount)) {
+            break;
+        }
+    }
+}
+
+static void train_model(Table *table, char *body, uint32_t body_len, int fd) {
+    if (body_len == 0) {
+        write_error(fd, "no level given");
+        return;
+    }
+
+    uint32_t level_width = 0;
+    uint32_t level_height = 0;
+    char *level = parse_level(body, &level_width, &level_height);
+    if (NULL == level) {
+        write_error(fd, "invalid level");
+        return;
+    }
+
+    if (level_width != table->row_width) {
+        write_error(fd, "level width does not match the model");
+        free(level);
+        return;
+    }
+
+    if (table->constant) {
+        write_error(fd, "built in models can not be trained");
+        free(level);
+        return;
+    }
+
+    bool trained = table_train(table, level_height, level);
+    free(level);
+
+    if (!trained) {
+        write_error(fd, "level has more tile types than the model");
+        return;
+    }
+
+    table_read_lock(table);
+    char response[64];
+    int len = snprintf(response, sizeof(response), "ok %d rows\n", table->num_rows);
+    table_read_unlock(table);
+
+    write_all(fd, response, len);
+}
+
+static Model *find_model(Server *server, char const *name) {
+    for (uint32_t model_index = 0; model_index < server->num_models; model_index++) {
+        if (0 == strcmp(server->models[model_index].name, name)) {
+            return &server->models[model_index];
+        }
+    }
+
+    return NULL;
+}
+
+static bool write_all(int fd, char const *data, size_t len) {
+    while (len > 0) {
+        ssize_t amount = write(fd, data, len);
+        if (amount < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += amount;
+        len -= amount;
+    }
+
+    return true;
+}
+
+static void write_error(int fd, char const *message) {
+    char response[MAX_REQUEST];
+    int len = snprintf(response, sizeof(response), "error: %s\n", message);
+    write_all(fd, response, len);
+}
+
+int server_request(char const *socket_path, int num_words, char **words) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path '%s' is too long!\n", socket_path);
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(fd >= 0);
+
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "Could not connect to '%s'!\n", socket_path);
+        close(fd);
+        return 1;
+    }
+
+    for (int word_index = 0; word_index < num_words; word_index++) {
+        write_all(fd, words[word_index], strlen(words[word_index]));
+        write_all(fd, word_index + 1 < num_words ? " " : "\n", 1);
+    }
+
+    // a server that rejects a level stops reading it, and its error should
+    // still be printed
+    signal(SIGPIPE, SIG_IGN);
+
+    char buffer[ROW_CHUNK];
+    if ((num_words > 0) && (0 == strcmp(words[0], "train"))) {
+        size_t amount = 0;
+        while ((amount = fread(buffer, 1, sizeof(buffer), stdin)) > 0) {
+            if (!write_all(fd, buffer, amount)) {
+                break;
+            }
+        }
+    }
+    shutdown(fd, SHUT_WR);
+
+    ssize_t amount = 0;
+    while ((amount = read(fd, buffer, sizeof(buffer))) > 0) {
+        fwrite(buffer, 1, amount, stdout);
+    }
+
+    close(fd);
+
+    return 0;
+}
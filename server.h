@@ -0,0 +1,44 @@
+#ifndef DOWNGEN_SERVER
+#define DOWNGEN_SERVER
+
+#include <stdint.h>
+
+#include <pthread.h>
+
+#include "generate.h"
+#include "table.h"
+#include "walk.h"
+
+
+#define DEFAULT_WORKERS 4
+#define CHECKPOINT_CACHE 16
+
+
+typedef struct Model {
+    char const *name;
+    Table *table;
+
+    // checkpoints for recently requested seeds, so clients can seek into
+    // long levels without the server walking from the start every time
+    pthread_mutex_t checkpoint_mutex;
+    Checkpoints *checkpoints[CHECKPOINT_CACHE];
+    uint32_t next_checkpoints;
+} Model;
+
+
+// serve requests for the given models on a unix domain socket until killed.
+// each connection carries one request line, and the response is written
+// back before the connection is closed:
+//   rows MODEL N SEED [START]  N rows of the model as a level file, from
+//                              row START of the level for that seed
+//   gif MODEL N SEED [START]   a GIF of N frames, using the server's config
+//   train MODEL                train the model on the level sent after the
+//                              request line, up to the end of the connection
+void server_run(char const *socket_path, Config *config, uint32_t out_height,
+                Model *models, uint32_t num_models, uint32_t num_workers);
+
+// send a request made from the given words to a server, and copy the
+// response to stdout. for 'train' the level is read from stdin.
+int server_request(char const *socket_path, int num_words, char **words);
+
+#endif
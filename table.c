@@ -5,196 +5,1048 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "table.h"
 
 
-#define INVALID_ROW 0xFFFFFFFF
+#define INITIAL_ROWS 16
+#define INITIAL_TRANSITIONS 4
+
+// the fewest rows of a level given to each training thread, below which
+// starting threads costs more than it saves
+#define TRAIN_CHUNK_ROWS 16384
+
+
+// a transition counted by one training thread
+typedef struct Counted {
+    uint32_t row_index;
+    uint32_t next_row;
+    uint32_t count;
+} Counted;
+
+typedef struct CountList {
+    uint32_t size;
+    uint32_t capacity;
+    Counted *counts;
+} CountList;
+
+// one thread's share of a training pass. its rows are interned into a
+// vocabulary of its own, and its transitions counted into lists split by
+// the thread that owns each row. merging these in thread order gives the
+// same table, down to the order of rows and transitions, as training on
+// one thread.
+typedef struct TrainWorker {
+    pthread_t thread;
+    uint32_t index;
+    struct TrainShared *shared;
+
+    // the distinct bitmaps of the chunk, in order of first appearance, and
+    // their indices in the table once interned
+    uint32_t num_bitmaps;
+    Bitmap *bitmaps;
+    uint32_t *interned;
+
+    // one list per thread
+    CountList *counts;
+} TrainWorker;
+
+typedef struct TrainShared {
+    Table *table;
+    uint32_t height;
+    char const *level;
+    uint32_t *indices;
+
+    uint32_t num_threads;
+    TrainWorker *workers;
+    pthread_barrier_t barrier;
+} TrainShared;
 
 
 void print_row(Table *table, uint32_t row_index);
-uint32_t unique_rows(uint32_t width, uint32_t height, char const * const level);
-Bitmap bitmap(uint32_t width, char const * const row);
 
+static uint32_t hash_bitmap(Table *table, Bitmap bitmap);
+static void grow_lookup(Table *table);
+static uint32_t intern_row(Table *table, Bitmap bitmap);
+static void add_transition(Table *table, uint32_t row_index, uint32_t next_row, uint32_t count);
+static void append_transition(Row *row, uint32_t next_row, uint32_t count);
+static void mark_dirty(Table *table, uint32_t row_index);
+static void rebuild_sampler(Row *row);
+static Bitmap row_bitmap(Table *table, uint32_t row);
+static void add_novelty(Table *table, uint32_t *indices, uint32_t height);
+static Bitmap level_row(Table *table, char const *level, uint32_t row_index, uint32_t *orientation);
+static void train_chunks(Table *table, uint32_t height, char const *level, uint32_t *indices, uint32_t num_threads);
+static void *train_worker(void *arg);
+static void intern_chunk(TrainWorker *worker, uint32_t start, uint32_t end);
+static void count_chunk(TrainWorker *worker, uint32_t start, uint32_t end);
+static void merge_counts(TrainWorker *worker);
+static uint64_t fingerprint_word(uint64_t hash, uint64_t word);
 
-Bitmap bitmap(uint32_t width, char const * const row) {
-    Bitmap map = 0;
 
-    for (uint32_t index = 0; index < width; index++) {
-        map = map << 1;
-        map |= row[index] == '1';
+static uint32_t hash_bitmap(Table *table, Bitmap bitmap) {
+    // fibonacci hashing- lookup_capacity is always a power of two
+    uint64_t hash = bitmap * 0x9E3779B97F4A7C15ULL;
+    return (uint32_t)(hash >> 32) & (table->lookup_capacity - 1);
+}
+
+uint32_t table_bitmap_index(Table *table, Bitmap bitmap) {
+    uint32_t slot = hash_bitmap(table, bitmap);
+
+    while (table->lookup[slot] != INVALID_ROW) {
+        uint32_t index = table->lookup[slot];
+        if (table->rows[index].bitmap == bitmap) {
+            return index;
+        }
+        slot = (slot + 1) & (table->lookup_capacity - 1);
     }
 
-    return map;
+    return INVALID_ROW;
 }
 
-uint32_t unique_rows(uint32_t width, uint32_t height, char const * const level) {
-    uint32_t reprs[height];
-    memset(reprs, 0, sizeof(height * sizeof(uint32_t)));
+static void grow_lookup(Table *table) {
+    free(table->lookup);
 
-    uint32_t num_reprs = 0;
+    table->lookup_capacity *= 2;
+    table->lookup = (uint32_t*)malloc(table->lookup_capacity * sizeof(uint32_t));
+    assert(NULL != table->lookup);
+    memset(table->lookup, 0xFF, table->lookup_capacity * sizeof(uint32_t));
 
-    for (uint32_t row_index = 0; row_index < height; row_index++) {
-        Bitmap map = bitmap(width, &level[row_index * width]);
+    for (uint32_t index = 0; index < table->num_rows; index++) {
+        uint32_t slot = hash_bitmap(table, table->rows[index].bitmap);
+        while (table->lookup[slot] != INVALID_ROW) {
+            slot = (slot + 1) & (table->lookup_capacity - 1);
+        }
+        table->lookup[slot] = index;
+    }
+}
 
-        bool new_repr = true;
-        for (uint32_t repr_index = 0; repr_index < num_reprs; repr_index++) {
-            if (reprs[repr_index] == map) {
-                new_repr = false;
-                break;
-            }
+// find the row for this bitmap, adding it to the table if it is new.
+// row indices never change once assigned.
+static uint32_t intern_row(Table *table, Bitmap bitmap) {
+    uint32_t index = table_bitmap_index(table, bitmap);
+    if (INVALID_ROW != index) {
+        return index;
+    }
+
+    if (table->num_rows == table->rows_capacity) {
+        table->rows_capacity *= 2;
+        table->rows = (Row*)realloc(table->rows, table->rows_capacity * sizeof(Row));
+        assert(NULL != table->rows);
+    }
+
+    index = table->num_rows;
+    assert(index < ROW_MIRRORED);
+    memset(&table->rows[index], 0, sizeof(Row));
+    table->rows[index].bitmap = bitmap;
+    table->num_rows++;
+
+    // keep the lookup at most half full
+    if ((table->num_rows * 2) > table->lookup_capacity) {
+        grow_lookup(table);
+    } else {
+        uint32_t slot = hash_bitmap(table, bitmap);
+        while (table->lookup[slot] != INVALID_ROW) {
+            slot = (slot + 1) & (table->lookup_capacity - 1);
         }
+        table->lookup[slot] = index;
+    }
+
+    return index;
+}
+
+static void mark_dirty(Table *table, uint32_t row_index) {
+    Row *row = &table->rows[row_index];
+
+    if (!row->dirty) {
+        row->dirty = true;
+        table->dirty_rows[table->num_dirty] = row_index;
+        table->num_dirty++;
+    }
+}
 
-        if (new_repr) {
-            reprs[num_reprs] = map;
-            num_reprs++;
+static void add_transition(Table *table, uint32_t row_index, uint32_t next_row, uint32_t count) {
+    mark_dirty(table, row_index);
+    append_transition(&table->rows[row_index], next_row, count);
+}
+
+static void append_transition(Row *row, uint32_t next_row, uint32_t count) {
+    row->total_transitions += count;
+
+    for (uint32_t trans_index = 0; trans_index < row->num_transitions; trans_index++) {
+        if (row->transitions[trans_index].next_row == next_row) {
+            row->transitions[trans_index].count += count;
+            return;
         }
     }
 
-    return num_reprs;
+    if (row->num_transitions == row->transitions_capacity) {
+        if (row->transitions_capacity == 0) {
+            row->transitions_capacity = INITIAL_TRANSITIONS;
+        } else {
+            row->transitions_capacity *= 2;
+        }
+        row->transitions =
+            (Transition*)realloc(row->transitions, row->transitions_capacity * sizeof(Transition));
+        assert(NULL != row->transitions);
+    }
+
+    row->transitions[row->num_transitions].next_row = next_row;
+    row->transitions[row->num_transitions].count = count;
+    row->num_transitions++;
 }
 
-uint32_t table_bitmap_index(Table *table, Bitmap bitmap) {
-    for (uint32_t index = 0; index < table->num_rows; index++) {
-        if (table->rows[index].bitmap == bitmap) {
-            return index;
+static void rebuild_sampler(Row *row) {
+    free(row->cumulative);
+    row->cumulative = (uint32_t*)malloc(row->num_transitions * sizeof(uint32_t));
+    assert(NULL != row->cumulative);
+
+    uint32_t total = 0;
+    for (uint32_t trans_index = 0; trans_index < row->num_transitions; trans_index++) {
+        total += row->transitions[trans_index].count;
+        row->cumulative[trans_index] = total;
+    }
+    assert(total == row->total_transitions);
+
+    row->dirty = false;
+}
+
+// the walk follows a level both ways, and in a mirrored table a mirror
+// image of a run is still a copy of it, so every one of these is indexed.
+// this reuses indices.
+static void add_novelty(Table *table, uint32_t *indices, uint32_t height) {
+    uint32_t num_flips = table->mirror ? 2 : 1;
+
+    for (uint32_t flip = 0; flip < num_flips; flip++) {
+        novelty_add(table->novelty, indices, height);
+
+        for (uint32_t row_index = 0; row_index < height / 2; row_index++) {
+            uint32_t swap = indices[row_index];
+            indices[row_index] = indices[height - 1 - row_index];
+            indices[height - 1 - row_index] = swap;
+        }
+        novelty_add(table->novelty, indices, height);
+
+        for (uint32_t row_index = 0; row_index < height; row_index++) {
+            indices[row_index] ^= ROW_MIRRORED;
         }
     }
+}
 
-    return INVALID_ROW;
+Table *table_create(uint32_t width, uint32_t height, char const * const level, uint32_t flags) {
+    Table *table = table_create_empty(width, bitmap_cell_bits(width, height, level), flags);
+
+    bool trained = table_train(table, height, level);
+    assert(trained);
+    assert(table->num_rows > 0);
+
+    return table;
 }
 
-Table *table_create(uint32_t width, uint32_t height, char const * const level) {
+Table *table_create_empty(uint32_t width, uint32_t bits_per_cell, uint32_t flags) {
     Table *table = (Table*)calloc(1, sizeof(Table));
+    assert(NULL != table);
 
     table->row_width = width;
+    table->bits_per_cell = bits_per_cell;
+    assert((width * table->bits_per_cell) <= 64);
+    table->kernels = bitmap_kernels(width, table->bits_per_cell);
+    table->mirror = (flags & TABLE_MIRROR) != 0;
+
+    table->rows_capacity = INITIAL_ROWS;
+    table->rows = (Row*)calloc(table->rows_capacity, sizeof(Row));
+    assert(NULL != table->rows);
+
+    table->lookup_capacity = INITIAL_ROWS;
+    table->lookup = (uint32_t*)malloc(table->lookup_capacity * sizeof(uint32_t));
+    assert(NULL != table->lookup);
+    memset(table->lookup, 0xFF, table->lookup_capacity * sizeof(uint32_t));
+
+    int retval = pthread_rwlock_init(&table->lock, NULL);
+    assert(0 == retval);
+
+    return table;
+}
+
+// feed another level into an existing table. new rows are appended, so
+// existing row indices stay valid, and only the rows whose transitions
+// changed have their sampling data rebuilt. generators holding the read
+// lock see the table either entirely before or entirely after this call.
+// returns false, leaving the table alone, if the level has tile types that
+// do not fit in the table's cells.
+bool table_train(Table *table, uint32_t height, char const * const level) {
+    return table_train_threads(table, height, level, 1);
+}
+
+bool table_train_threads(Table *table, uint32_t height, char const * const level, uint32_t num_threads) {
+    if (height == 0) {
+        return true;
+    }
+
+    uint32_t width = table->row_width;
+
+    assert(!table->constant);
+    if (bitmap_cell_bits(width, height, level) > table->bits_per_cell) {
+        return false;
+    }
+
+    if (num_threads > height / TRAIN_CHUNK_ROWS) {
+        num_threads = height / TRAIN_CHUNK_ROWS;
+    }
+
+    // intern every row up front, so the transitions can refer to indices
+    uint32_t *indices = (uint32_t*)malloc(height * sizeof(uint32_t));
+    assert(NULL != indices);
+
+    pthread_rwlock_wrlock(&table->lock);
+
+    if (num_threads > 1) {
+        train_chunks(table, height, level, indices, num_threads);
+    } else {
+        for (uint32_t row_index = 0; row_index < height; row_index++) {
+            uint32_t orientation;
+            Bitmap map = level_row(table, level, row_index, &orientation);
+            indices[row_index] = intern_row(table, map) | orientation;
+        }
+
+        // at most one dirty entry per row
+        table->dirty_rows = (uint32_t*)realloc(table->dirty_rows, table->num_rows * sizeof(uint32_t));
+        assert(NULL != table->dirty_rows);
+        table->num_dirty = 0;
+
+        // the level wraps around, so the first row follows the last. mirrored
+        // transitions record whether the orientation changes, so a row and its
+        // mirror image share their transitions.
+        for (uint32_t row_index = 0; row_index < height; row_index++) {
+            uint32_t next_row_index = (row_index + 1) % height;
+            uint32_t prev_row_index = (row_index + height - 1) % height;
+
+            uint32_t current = indices[row_index];
+            uint32_t next = indices[next_row_index];
+            uint32_t prev = indices[prev_row_index];
+
+            add_transition(table, ROW_INDEX(current), ROW_INDEX(next) | ((current ^ next) & ROW_MIRRORED), 1);
+            add_transition(table, ROW_INDEX(current), ROW_INDEX(prev) | ((current ^ prev) & ROW_MIRRORED), 1);
+        }
+
+        for (uint32_t dirty_index = 0; dirty_index < table->num_dirty; dirty_index++) {
+            rebuild_sampler(&table->rows[table->dirty_rows[dirty_index]]);
+        }
+        table->num_dirty = 0;
+    }
+
+    if (NULL != table->novelty) {
+        add_novelty(table, indices, height);
+    }
+    table->version++;
+
+    pthread_rwlock_unlock(&table->lock);
+
+    free(indices);
+
+    return true;
+}
+
+// pack a row of the level. a mirrored table keeps the lesser of a row and
+// its mirror image, setting orientation to ROW_MIRRORED if it took the
+// mirror image.
+static Bitmap level_row(Table *table, char const *level, uint32_t row_index, uint32_t *orientation) {
+    uint32_t width = table->row_width;
+    Bitmap map = table->kernels.pack(width, &level[row_index * width]);
+
+    *orientation = 0;
+    if (table->mirror) {
+        Bitmap mirrored = bitmap_mirror(map, width, table->bits_per_cell);
+        if (mirrored < map) {
+            map = mirrored;
+            *orientation = ROW_MIRRORED;
+        }
+    }
+
+    return map;
+}
+
+// train on the level in num_threads chunks. the table's rows are only
+// appended to by the first thread, between barriers, and each row's
+// transitions only by the thread that owns it, so no further locking is
+// needed.
+static void train_chunks(Table *table, uint32_t height, char const *level, uint32_t *indices, uint32_t num_threads) {
+    TrainShared shared;
+    shared.table = table;
+    shared.height = height;
+    shared.level = level;
+    shared.indices = indices;
+    shared.num_threads = num_threads;
+    shared.workers = (TrainWorker*)calloc(num_threads, sizeof(TrainWorker));
+    assert(NULL != shared.workers);
+    pthread_barrier_init(&shared.barrier, NULL, num_threads);
+
+    for (uint32_t worker_index = 0; worker_index < num_threads; worker_index++) {
+        TrainWorker *worker = &shared.workers[worker_index];
+        worker->index = worker_index;
+        worker->shared = &shared;
+        worker->counts = (CountList*)calloc(num_threads, sizeof(CountList));
+        assert(NULL != worker->counts);
+    }
+
+    // this thread works on the first chunk
+    for (uint32_t worker_index = 1; worker_index < num_threads; worker_index++) {
+        TrainWorker *worker = &shared.workers[worker_index];
+        int result = pthread_create(&worker->thread, NULL, train_worker, worker);
+        assert(0 == result);
+    }
+    train_worker(&shared.workers[0]);
+    for (uint32_t worker_index = 1; worker_index < num_threads; worker_index++) {
+        pthread_join(shared.workers[worker_index].thread, NULL);
+    }
+
+    for (uint32_t worker_index = 0; worker_index < num_threads; worker_index++) {
+        TrainWorker *worker = &shared.workers[worker_index];
+        free(worker->bitmaps);
+        free(worker->interned);
+        for (uint32_t owner = 0; owner < num_threads; owner++) {
+            free(worker->counts[owner].counts);
+        }
+        free(worker->counts);
+    }
+    pthread_barrier_destroy(&shared.barrier);
+    free(shared.workers);
+}
+
+static void *train_worker(void *arg) {
+    TrainWorker *worker = (TrainWorker*)arg;
+    TrainShared *shared = worker->shared;
+    Table *table = shared->table;
+    uint32_t *indices = shared->indices;
+
+    uint32_t start = (uint32_t)(((uint64_t)shared->height * worker->index) / shared->num_threads);
+    uint32_t end = (uint32_t)(((uint64_t)shared->height * (worker->index + 1)) / shared->num_threads);
+
+    intern_chunk(worker, start, end);
+    pthread_barrier_wait(&shared->barrier);
+
+    // interning the chunks' bitmaps in chunk order assigns rows the same
+    // indices as interning the whole level in order
+    if (0 == worker->index) {
+        for (uint32_t worker_index = 0; worker_index < shared->num_threads; worker_index++) {
+            TrainWorker *chunk = &shared->workers[worker_index];
+            for (uint32_t bitmap_index = 0; bitmap_index < chunk->num_bitmaps; bitmap_index++) {
+                chunk->interned[bitmap_index] = intern_row(table, chunk->bitmaps[bitmap_index]);
+            }
+        }
+    }
+    pthread_barrier_wait(&shared->barrier);
+
+    for (uint32_t row_index = start; row_index < end; row_index++) {
+        uint32_t local = indices[row_index];
+        indices[row_index] = worker->interned[ROW_INDEX(local)] | (local & ROW_MIRRORED);
+    }
+    pthread_barrier_wait(&shared->barrier);
+
+    // counting reads the indices either side of the chunk
+    count_chunk(worker, start, end);
+    pthread_barrier_wait(&shared->barrier);
+
+    merge_counts(worker);
+
+    return NULL;
+}
+
+// pack the chunk's rows, leaving the index of each in the chunk's own
+// vocabulary of bitmaps in indices
+static void intern_chunk(TrainWorker *worker, uint32_t start, uint32_t end) {
+    TrainShared *shared = worker->shared;
+    Table *table = shared->table;
+
+    // kept at most half full
+    uint32_t capacity = 1;
+    while (capacity < (end - start) * 2) {
+        capacity *= 2;
+    }
+    uint32_t *lookup = (uint32_t*)malloc(capacity * sizeof(uint32_t));
+    assert(NULL != lookup);
+    memset(lookup, 0xFF, capacity * sizeof(uint32_t));
+
+    worker->bitmaps = (Bitmap*)malloc((end - start) * sizeof(Bitmap));
+    assert(NULL != worker->bitmaps);
+    worker->num_bitmaps = 0;
+
+    for (uint32_t row_index = start; row_index < end; row_index++) {
+        uint32_t orientation;
+        Bitmap map = level_row(table, shared->level, row_index, &orientation);
+
+        uint64_t hash = map * 0x9E3779B97F4A7C15ULL;
+        uint32_t slot = (uint32_t)(hash >> 32) & (capacity - 1);
+        while (lookup[slot] != INVALID_ROW && worker->bitmaps[lookup[slot]] != map) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        if (lookup[slot] == INVALID_ROW) {
+            lookup[slot] = worker->num_bitmaps;
+            worker->bitmaps[worker->num_bitmaps] = map;
+            worker->num_bitmaps++;
+        }
+
+        shared->indices[row_index] = lookup[slot] | orientation;
+    }
+
+    worker->interned = (uint32_t*)malloc(worker->num_bitmaps * sizeof(uint32_t));
+    assert(NULL != worker->interned);
+
+    free(lookup);
+}
+
+// count the transitions from the chunk's rows, in the same order as
+// training on one thread. each distinct transition is listed once, for the
+// thread owning its row, in order of first occurrence.
+static void count_chunk(TrainWorker *worker, uint32_t start, uint32_t end) {
+    TrainShared *shared = worker->shared;
+    uint32_t const *indices = shared->indices;
+    uint32_t height = shared->height;
+    uint32_t num_threads = shared->num_threads;
+
+    // each row has at most two distinct transitions. slots hold the owner
+    // and the position in its list of each transition counted.
+    uint32_t capacity = 1;
+    while (capacity < (end - start) * 4) {
+        capacity *= 2;
+    }
+    uint64_t *keys = (uint64_t*)malloc(capacity * sizeof(uint64_t));
+    uint32_t *owners = (uint32_t*)malloc(capacity * sizeof(uint32_t));
+    uint32_t *positions = (uint32_t*)malloc(capacity * sizeof(uint32_t));
+    assert(NULL != keys && NULL != owners && NULL != positions);
+    memset(owners, 0xFF, capacity * sizeof(uint32_t));
 
-    uint32_t num_unique_rows = unique_rows(width, height, level);
-    assert(num_unique_rows > 0);
+    for (uint32_t row_index = start; row_index < end; row_index++) {
+        uint32_t current = indices[row_index];
+        uint32_t neighbours[2] = {
+            indices[(row_index + 1) % height],
+            indices[(row_index + height - 1) % height],
+        };
 
-    table->num_rows = num_unique_rows;
+        for (uint32_t side = 0; side < 2; side++) {
+            uint32_t from = ROW_INDEX(current);
+            uint32_t to = ROW_INDEX(neighbours[side]) | ((current ^ neighbours[side]) & ROW_MIRRORED);
+            uint64_t key = ((uint64_t)from << 32) | to;
 
-    table->rows = (Row*)calloc(table->num_rows, sizeof(Row));
+            uint64_t hash = key * 0x9E3779B97F4A7C15ULL;
+            uint32_t slot = (uint32_t)(hash >> 32) & (capacity - 1);
+            while (owners[slot] != INVALID_ROW && keys[slot] != key) {
+                slot = (slot + 1) & (capacity - 1);
+            }
 
-    uint32_t num_reprs = 0;
-    for (uint32_t row_index = 0; row_index < height; row_index++) {
-        Bitmap map = bitmap(width, &level[row_index * width]);
+            if (owners[slot] != INVALID_ROW) {
+                worker->counts[owners[slot]].counts[positions[slot]].count++;
+                continue;
+            }
 
-        bool new_repr = true;
-        for (uint32_t repr_index = 0; repr_index < num_reprs; repr_index++) {
-            if (table->rows[repr_index].bitmap == map) {
-                new_repr = false;
-                break;
+            uint32_t owner = from % num_threads;
+            CountList *list = &worker->counts[owner];
+            if (list->size == list->capacity) {
+                list->capacity = (list->capacity == 0) ? INITIAL_TRANSITIONS : list->capacity * 2;
+                list->counts = (Counted*)realloc(list->counts, list->capacity * sizeof(Counted));
+                assert(NULL != list->counts);
             }
+            list->counts[list->size] = (Counted){from, to, 1};
+
+            keys[slot] = key;
+            owners[slot] = owner;
+            positions[slot] = list->size;
+            list->size++;
         }
+    }
+
+    free(keys);
+    free(owners);
+    free(positions);
+}
+
+// add the transitions counted by every thread for the rows this thread owns,
+// in chunk order, then rebuild those rows' samplers
+static void merge_counts(TrainWorker *worker) {
+    TrainShared *shared = worker->shared;
+    Table *table = shared->table;
+
+    uint32_t max_dirty = 0;
+    for (uint32_t worker_index = 0; worker_index < shared->num_threads; worker_index++) {
+        max_dirty += shared->workers[worker_index].counts[worker->index].size;
+    }
+    uint32_t *dirty_rows = (uint32_t*)malloc((max_dirty + 1) * sizeof(uint32_t));
+    assert(NULL != dirty_rows);
+    uint32_t num_dirty = 0;
 
-        if (new_repr) {
-            table->rows[num_reprs].bitmap = map;
-            num_reprs++;
+    for (uint32_t worker_index = 0; worker_index < shared->num_threads; worker_index++) {
+        CountList *list = &shared->workers[worker_index].counts[worker->index];
+        for (uint32_t count_index = 0; count_index < list->size; count_index++) {
+            Counted *counted = &list->counts[count_index];
+            Row *row = &table->rows[counted->row_index];
+            if (!row->dirty) {
+                row->dirty = true;
+                dirty_rows[num_dirty] = counted->row_index;
+                num_dirty++;
+            }
+            append_transition(row, counted->next_row, counted->count);
         }
     }
 
-    assert(num_reprs == num_unique_rows);
+    for (uint32_t dirty_index = 0; dirty_index < num_dirty; dirty_index++) {
+        rebuild_sampler(&table->rows[dirty_rows[dirty_index]]);
+    }
 
-    table->transitions = (uint32_t*)calloc(table->num_rows, table->num_rows * sizeof(uint32_t)); 
+    free(dirty_rows);
+}
 
-    for (uint32_t row_index = 0; row_index < height; row_index++) {
-        Bitmap start_bitmap = bitmap(width, &level[row_index * width]);
+uint32_t table_add_row(Table *table, Bitmap bitmap) {
+    assert(!table->constant);
+    return intern_row(table, bitmap);
+}
+
+void table_set_transitions(Table *table, uint32_t row_index, uint32_t num_transitions, Transition const *transitions) {
+    assert(!table->constant);
+    Row *row = &table->rows[row_index];
+
+    row->transitions_capacity = num_transitions;
+    row->num_transitions = num_transitions;
+    row->transitions = (Transition*)realloc(row->transitions, (num_transitions + 1) * sizeof(Transition));
+    assert(NULL != row->transitions);
+    memcpy(row->transitions, transitions, num_transitions * sizeof(Transition));
+
+    row->total_transitions = 0;
+    for (uint32_t trans_index = 0; trans_index < num_transitions; trans_index++) {
+        row->total_transitions += transitions[trans_index].count;
+    }
+    rebuild_sampler(row);
+}
+
+// a saved table is a header followed by each row in index order- its
+// bitmap, its number of transitions, then its transitions
+bool table_write_header(FILE *file, uint32_t width, uint32_t bits_per_cell, uint32_t flags, uint32_t num_rows) {
+    uint32_t header[] = { TABLE_FILE_VERSION, width, bits_per_cell, flags, num_rows };
+
+    bool ok = fwrite(TABLE_FILE_MAGIC, 4, 1, file) == 1;
+    ok = ok && fwrite(header, sizeof(header), 1, file) == 1;
+
+    return ok;
+}
+
+bool table_write_row(FILE *file, Bitmap bitmap, uint32_t num_transitions, Transition *transitions) {
+    bool ok = fwrite(&bitmap, sizeof(Bitmap), 1, file) == 1;
+    ok = ok && fwrite(&num_transitions, sizeof(uint32_t), 1, file) == 1;
+    if (num_transitions > 0) {
+        ok = ok && fwrite(transitions, sizeof(Transition), num_transitions, file) == num_transitions;
+    }
+
+    return ok;
+}
+
+bool table_save(Table *table, char const *file_name) {
+    FILE *file = fopen(file_name, "wb");
+    if (NULL == file) {
+        return false;
+    }
+
+    uint32_t flags = table->mirror ? TABLE_MIRROR : 0;
+    bool ok = table_write_header(file, table->row_width, table->bits_per_cell, flags, table->num_rows);
+
+    for (uint32_t row_index = 0; ok && (row_index < table->num_rows); row_index++) {
+        Row *row = &table->rows[row_index];
+        ok = table_write_row(file, row->bitmap, row->num_transitions, row->transitions);
+    }
+
+    ok = (0 == fclose(file)) && ok;
+
+    return ok;
+}
 
-        uint32_t next_row_index = (row_index + 1) % table->num_rows;
-        uint32_t prev_row_index = row_index - 1;
-        if (row_index == 0) {
-            prev_row_index = table->num_rows - 1;
+// the rows, transitions, samplers and lookup are each written as one const
+// array, with rows pointing into the others. only the Table itself is left
+// writable, for its lock and its kernels, which are static in bitmap.c.
+bool table_write_source(Table *table, char const *file_name) {
+    FILE *file = fopen(file_name, "w");
+    if (NULL == file) {
+        return false;
+    }
+
+    fprintf(file, "// generated by downgen --source. do not edit.\n");
+    fprintf(file, "#include <stddef.h>\n\n#include \"table.h\"\n\n\n");
+
+    uint64_t num_transitions = 0;
+    for (uint32_t row_index = 0; row_index < table->num_rows; row_index++) {
+        num_transitions += table->rows[row_index].num_transitions;
+    }
+
+    // an empty array is not valid C, so there is always at least one entry
+    fprintf(file, "static const Transition transitions[%llu] = {\n", (unsigned long long)num_transitions + 1);
+    for (uint32_t row_index = 0; row_index < table->num_rows; row_index++) {
+        Row *row = &table->rows[row_index];
+        for (uint32_t trans_index = 0; trans_index < row->num_transitions; trans_index++) {
+            fprintf(file, "    { 0x%08X, %u },\n", row->transitions[trans_index].next_row, row->transitions[trans_index].count);
         }
-        Bitmap next_bitmap = bitmap(width, &level[next_row_index * width]);
-        Bitmap prev_bitmap = bitmap(width, &level[prev_row_index * width]);
+    }
+    fprintf(file, "    { 0, 0 },\n};\n\n");
+
+    fprintf(file, "static const uint32_t cumulative[%llu] = {\n", (unsigned long long)num_transitions + 1);
+    for (uint32_t row_index = 0; row_index < table->num_rows; row_index++) {
+        Row *row = &table->rows[row_index];
+        for (uint32_t trans_index = 0; trans_index < row->num_transitions; trans_index++) {
+            fprintf(file, "    %u,\n", row->cumulative[trans_index]);
+        }
+    }
+    fprintf(file, "    0,\n};\n\n");
+
+    fprintf(file, "static const Row rows[%u] = {\n", table->num_rows);
+    uint64_t offset = 0;
+    for (uint32_t row_index = 0; row_index < table->num_rows; row_index++) {
+        Row *row = &table->rows[row_index];
+        fprintf(file, "    { 0x%016llXULL, %u, %u, %u, (Transition*)&transitions[%llu], (uint32_t*)&cumulative[%llu], false },\n",
+                (unsigned long long)row->bitmap, row->total_transitions, row->num_transitions, row->num_transitions,
+                (unsigned long long)offset, (unsigned long long)offset);
+        offset += row->num_transitions;
+    }
+    fprintf(file, "};\n\n");
+
+    fprintf(file, "static const uint32_t lookup[%u] = {\n", table->lookup_capacity);
+    for (uint32_t slot = 0; slot < table->lookup_capacity; slot++) {
+        fprintf(file, "    0x%08X,\n", table->lookup[slot]);
+    }
+    fprintf(file, "};\n\n");
 
-        uint32_t start_index = table_bitmap_index(table, start_bitmap);
-        assert(INVALID_ROW != start_index);
+    fprintf(file, "static Table table = {\n");
+    fprintf(file, "    .row_width = %u,\n", table->row_width);
+    fprintf(file, "    .bits_per_cell = %u,\n", table->bits_per_cell);
+    fprintf(file, "    .mirror = %s,\n", table->mirror ? "true" : "false");
+    fprintf(file, "    .num_rows = %u,\n", table->num_rows);
+    fprintf(file, "    .rows_capacity = %u,\n", table->num_rows);
+    fprintf(file, "    .rows = (Row*)rows,\n");
+    fprintf(file, "    .lookup_capacity = %u,\n", table->lookup_capacity);
+    fprintf(file, "    .lookup = (uint32_t*)lookup,\n");
+    fprintf(file, "    .dirty_rows = NULL,\n");
+    fprintf(file, "    .lock = PTHREAD_RWLOCK_INITIALIZER,\n");
+    fprintf(file, "    .constant = true,\n");
+    fprintf(file, "};\n\n");
 
-        uint32_t next_index = table_bitmap_index(table, next_bitmap);
-        assert(INVALID_ROW != next_index);
+    fprintf(file, "Table *table_embedded(void) {\n");
+    fprintf(file, "    table.kernels = bitmap_kernels(%u, %u);\n", table->row_width, table->bits_per_cell);
+    fprintf(file, "    return &table;\n");
+    fprintf(file, "}\n");
 
-        uint32_t prev_index = table_bitmap_index(table, prev_bitmap);
-        assert(INVALID_ROW != prev_index);
+    bool ok = !ferror(file);
+    ok = (0 == fclose(file)) && ok;
 
-        uint32_t transition_index = 0;
+    return ok;
+}
+
+Table *table_load(char const *file_name) {
+    FILE *file = fopen(file_name, "rb");
+    if (NULL == file) {
+        return NULL;
+    }
 
-        transition_index = start_index * table->num_rows + next_index;
-        table->transitions[transition_index]++;
+    char magic[4];
+    uint32_t header[5];
+    bool ok = fread(magic, 4, 1, file) == 1 && (0 == memcmp(magic, TABLE_FILE_MAGIC, 4));
+    ok = ok && fread(header, sizeof(header), 1, file) == 1;
+    ok = ok && (header[0] == TABLE_FILE_VERSION);
+    ok = ok && ((header[2] == 1) || (header[2] == 2) || (header[2] == 4));
+    ok = ok && (header[1] > 0) && ((header[1] * header[2]) <= 64) && (header[4] > 0);
 
-        transition_index = start_index * table->num_rows + prev_index;
-        table->transitions[transition_index]++;
+    // the counts in the file are checked against the bytes left in it
+    // before anything is allocated from them
+    long header_end = ftell(file);
+    ok = ok && (header_end >= 0) && (0 == fseek(file, 0, SEEK_END));
+    long file_end = ftell(file);
+    ok = ok && (file_end >= header_end) && (0 == fseek(file, header_end, SEEK_SET));
+    uint64_t bytes_left = ok ? (uint64_t)(file_end - header_end) : 0;
+
+    // every row has a bitmap, a count and at least one transition
+    size_t row_size = sizeof(Bitmap) + sizeof(uint32_t);
+    ok = ok && (header[4] <= bytes_left / (row_size + sizeof(Transition)));
+    if (!ok) {
+        fclose(file);
+        return NULL;
+    }
+
+    uint32_t num_rows = header[4];
+    Table *table = table_create_empty(header[1], header[2], header[3]);
+
+    // rows are interned in file order, so they keep their indices
+    table->dirty_rows = (uint32_t*)malloc((size_t)num_rows * sizeof(uint32_t));
+    ok = NULL != table->dirty_rows;
+
+    for (uint32_t row_index = 0; ok && (row_index < num_rows); row_index++) {
+        Bitmap bitmap = 0;
+        uint32_t num_transitions = 0;
+        ok = fread(&bitmap, sizeof(Bitmap), 1, file) == 1;
+        ok = ok && fread(&num_transitions, sizeof(uint32_t), 1, file) == 1;
+        bytes_left -= row_size;
+        ok = ok && (num_transitions > 0) && (num_transitions <= bytes_left / sizeof(Transition));
+        ok = ok && (intern_row(table, bitmap) == row_index);
+        if (!ok) {
+            break;
+        }
+        bytes_left -= (uint64_t)num_transitions * sizeof(Transition);
+
+        Row *row = &table->rows[row_index];
+        row->transitions = (Transition*)malloc(((size_t)num_transitions + 1) * sizeof(Transition));
+        if (NULL == row->transitions) {
+            ok = false;
+            break;
+        }
+        row->transitions_capacity = num_transitions;
+        row->num_transitions = num_transitions;
+        ok = fread(row->transitions, sizeof(Transition), num_transitions, file) == num_transitions;
+
+        // a row must be able to step somewhere, its counts must fit its
+        // total, and only mirrored tables can flip orientation
+        uint64_t total = 0;
+        for (uint32_t trans_index = 0; ok && (trans_index < num_transitions); trans_index++) {
+            uint32_t next_row = row->transitions[trans_index].next_row;
+            ok = (ROW_INDEX(next_row) < num_rows) && (table->mirror || !(next_row & ROW_MIRRORED));
+            total += row->transitions[trans_index].count;
+        }
+        ok = ok && (total > 0) && (total <= UINT32_MAX);
+        row->total_transitions = (uint32_t)total;
+        mark_dirty(table, row_index);
+    }
+
+    fclose(file);
+
+    if (!ok) {
+        table_destroy(&table);
+        return NULL;
+    }
 
-        table->rows[start_index].total_transitions += 2;
+    for (uint32_t dirty_index = 0; dirty_index < table->num_dirty; dirty_index++) {
+        rebuild_sampler(&table->rows[table->dirty_rows[dirty_index]]);
     }
-    
+    table->num_dirty = 0;
+    table->version++;
+
     return table;
 }
 
+void table_read_lock(Table *table) {
+    pthread_rwlock_rdlock(&table->lock);
+}
+
+void table_read_unlock(Table *table) {
+    pthread_rwlock_unlock(&table->lock);
+}
+
+uint64_t table_fingerprint(Table *table) {
+    uint64_t hash = 0;
+    hash = fingerprint_word(hash, table->row_width);
+    hash = fingerprint_word(hash, table->bits_per_cell);
+    hash = fingerprint_word(hash, table->mirror);
+    hash = fingerprint_word(hash, table->num_rows);
+
+    for (uint32_t row_index = 0; row_index < table->num_rows; row_index++) {
+        Row *row = &table->rows[row_index];
+        hash = fingerprint_word(hash, row->bitmap);
+        hash = fingerprint_word(hash, row->num_transitions);
+        for (uint32_t trans_index = 0; trans_index < row->num_transitions; trans_index++) {
+            Transition *transition = &row->transitions[trans_index];
+            hash = fingerprint_word(hash, ((uint64_t)transition->next_row << 32) | transition->count);
+        }
+    }
+
+    Novelty *novelty = table->novelty;
+    if (NULL == novelty) {
+        return fingerprint_word(hash, 0);
+    }
+
+    hash = fingerprint_word(hash, novelty->max_copy);
+    hash = fingerprint_word(hash, novelty->num_states);
+    for (uint32_t state = 0; state < novelty->num_states; state++) {
+        hash = fingerprint_word(hash, ((uint64_t)novelty->states[state].length << 32) | novelty->states[state].link);
+    }
+    hash = fingerprint_word(hash, novelty->num_edges);
+    for (uint32_t edge_index = 0; edge_index < novelty->num_edges; edge_index++) {
+        NoveltyEdge *edge = &novelty->edges[edge_index];
+        hash = fingerprint_word(hash, ((uint64_t)edge->source << 32) | edge->row);
+        hash = fingerprint_word(hash, edge->target);
+    }
+
+    return hash;
+}
+
+static uint64_t fingerprint_word(uint64_t hash, uint64_t word) {
+    return rng_mix(hash ^ rng_mix(word + 0x9E3779B97F4A7C15ULL));
+}
+
 void table_print(Table *table) {
     printf("Unique Rows:\n");
     for (uint32_t row_index = 0; row_index < table->num_rows; row_index++) {
         print_row(table, row_index);
     }
 
+    uint32_t *counts = (uint32_t*)calloc(table->num_rows, sizeof(uint32_t));
+    assert(NULL != counts);
+
     printf("\nTransition Table:\n");
     for (uint32_t row_index = 0; row_index < table->num_rows; row_index++) {
+        Row *row = &table->rows[row_index];
+
+        for (uint32_t trans_index = 0; trans_index < row->num_transitions; trans_index++) {
+            counts[ROW_INDEX(row->transitions[trans_index].next_row)] += row->transitions[trans_index].count;
+        }
+
         for (uint32_t trans_index = 0; trans_index < table->num_rows; trans_index++) {
-            uint32_t index = row_index * table->num_rows + trans_index;
-            printf("%d ", table->transitions[index]);
+            printf("%d ", counts[trans_index]);
+        }
+        printf(" = %d\n", row->total_transitions);
+
+        for (uint32_t trans_index = 0; trans_index < row->num_transitions; trans_index++) {
+            counts[ROW_INDEX(row->transitions[trans_index].next_row)] = 0;
         }
-        printf(" = %d\n", table->rows[row_index].total_transitions);
     }
     printf("\n");
+
+    free(counts);
 }
 
 void print_row(Table *table, uint32_t row_index) {
+    uint8_t cells[64];
+    table->kernels.unpack(table->row_width, table->rows[row_index].bitmap, cells);
+
     for (uint32_t index = 0; index < table->row_width; index++) {
-        uint32_t mask = 1 << (table->row_width - index - 1);
-        Bitmap bit = mask & table->rows[row_index].bitmap;
-        printf("%c ", '0' + (bit != 0));
+        printf("%c ", bitmap_cell(cells[index]));
     }
     printf("\n");
 }
 
-uint32_t table_next_row(Table *table, uint32_t current_row) {
-    uint32_t count = rand() % (table->rows[current_row].total_transitions + 1);
-    uint32_t last_counted_row = INVALID_ROW;
+// the bitmap of a row, in the orientation the row index asks for
+static Bitmap row_bitmap(Table *table, uint32_t row) {
+    Bitmap bitmap = table->rows[ROW_INDEX(row)].bitmap;
+    if (row & ROW_MIRRORED) {
+        bitmap = bitmap_mirror(bitmap, table->row_width, table->bits_per_cell);
+    }
+    return bitmap;
+}
 
-    for (uint32_t trans_index = 0; trans_index < table->num_rows; trans_index++) {
-        uint32_t count_index = current_row * table->num_rows + trans_index;
+// write the row as cell characters, in the same format as a level file. the string must have room for row_width characters.
+void table_row_string(Table *table, uint32_t row_index, char *string) {
+    uint8_t *cells = (uint8_t*)string;
+    table->kernels.unpack(table->row_width, row_bitmap(table, row_index), cells);
 
-        if (table->transitions[count_index] != 0) {
-            if (count < table->transitions[count_index]) {
-                return trans_index;
-            }
+    for (uint32_t index = 0; index < table->row_width; index++) {
+        string[index] = bitmap_cell(cells[index]);
+    }
+}
+
+// the row of the table with the given cell characters, as in a level file,
+// or INVALID_ROW if there is none. in a mirrored table the row found may be
+// the mirror image of a row trained on.
+uint32_t table_find_row(Table *table, char const *string) {
+    if (strlen(string) != table->row_width) {
+        return INVALID_ROW;
+    }
+    for (uint32_t index = 0; index < table->row_width; index++) {
+        int symbol = bitmap_symbol(string[index]);
+        if ((symbol < 0) || (symbol >= (1 << table->bits_per_cell))) {
+            return INVALID_ROW;
+        }
+    }
+
+    Bitmap map = table->kernels.pack(table->row_width, string);
+
+    uint32_t orientation = 0;
+    if (table->mirror) {
+        Bitmap mirrored = bitmap_mirror(map, table->row_width, table->bits_per_cell);
+        if (mirrored < map) {
+            map = mirrored;
+            orientation = ROW_MIRRORED;
+        }
+    }
+
+    uint32_t index = table_bitmap_index(table, map);
+    return index == INVALID_ROW ? INVALID_ROW : index | orientation;
+}
+
+// in a mirrored table, the orientation of current_row carries over to the
+// row that follows it
+uint32_t table_next_row(Table *table, Rng *rng, uint32_t current_row) {
+    Row *row = &table->rows[ROW_INDEX(current_row)];
+    assert(row->num_transitions > 0);
+
+    uint32_t count = rng_next(rng) % row->total_transitions;
+
+    // find the first transition whose running total is above count
+    uint32_t low = 0;
+    uint32_t high = row->num_transitions - 1;
+    while (low < high) {
+        uint32_t mid = (low + high) / 2;
+        if (row->cumulative[mid] > count) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+
+    return row->transitions[low].next_row ^ (current_row & ROW_MIRRORED);
+}
 
-            count -= table->transitions[count_index];
-            last_counted_row = trans_index;
+uint32_t table_next_novel_row(Table *table, Rng *rng, uint32_t current_row, NoveltyMatch *match) {
+    uint32_t next_row = table_next_row(table, rng, current_row);
+    if ((NULL == table->novelty) || novelty_allows(table->novelty, match, next_row)) {
+        return next_row;
+    }
+
+    // draw again from the transitions that are allowed, in proportion to
+    // their counts
+    Row *row = &table->rows[ROW_INDEX(current_row)];
+    uint32_t orientation = current_row & ROW_MIRRORED;
+
+    uint32_t allowed_total = 0;
+    for (uint32_t trans_index = 0; trans_index < row->num_transitions; trans_index++) {
+        uint32_t candidate = row->transitions[trans_index].next_row ^ orientation;
+        if (novelty_allows(table->novelty, match, candidate)) {
+            allowed_total += row->transitions[trans_index].count;
+        }
+    }
+
+    // every way out copies the level, so copy it
+    if (allowed_total == 0) {
+        return next_row;
+    }
+
+    uint32_t count = rng_next(rng) % allowed_total;
+    for (uint32_t trans_index = 0; trans_index < row->num_transitions; trans_index++) {
+        uint32_t candidate = row->transitions[trans_index].next_row ^ orientation;
+        if (!novelty_allows(table->novelty, match, candidate)) {
+            continue;
+        }
+        if (count < row->transitions[trans_index].count) {
+            return candidate;
         }
+        count -= row->transitions[trans_index].count;
     }
 
-    return last_counted_row;
+    assert(false);
+    return next_row;
 }
 
 void table_destroy(Table **table) {
+    if ((*table)->constant) {
+        *table = NULL;
+        return;
+    }
+
+    for (uint32_t row_index = 0; row_index < (*table)->num_rows; row_index++) {
+        free((*table)->rows[row_index].transitions);
+        free((*table)->rows[row_index].cumulative);
+    }
     free((*table)->rows);
-    free((*table)->transitions);
+    free((*table)->lookup);
+    free((*table)->dirty_rows);
+    if (NULL != (*table)->novelty) {
+        novelty_destroy(&(*table)->novelty);
+    }
+    pthread_rwlock_destroy(&(*table)->lock);
     free(*table);
     *table = NULL;
 }
 
 
 void table_copy_row(Table *table, uint32_t current_row, Image *image) {
-    Bitmap bitmap = table->rows[current_row].bitmap;
-    for (uint32_t index = 0; index < table->row_width; index++) {
-        uint32_t mask = 1 << (table->row_width - index - 1);
-        Bitmap bit = mask & bitmap;
-        uint8_t color = bit != 0;
-
-        uint32_t grid_index = table->row_width * (image->height - 1) + index;
-        image->data[grid_index] = color;
-    }
+    uint32_t grid_index = table->row_width * (image->height - 1);
+    table->kernels.unpack(table->row_width, row_bitmap(table, current_row), &image->data[grid_index]);
 }
-
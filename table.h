@@ -2,20 +2,81 @@
 #define DOWNGEN_TABLE
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <pthread.h>
 
+#include "bitmap.h"
+#include "rng.h"
+#include "novelty.h"
 
-typedef uint64_t Bitmap;
+
+// table_create flags
+#define TABLE_MIRROR 0x1
+
+#define TABLE_FILE_MAGIC "DGMD"
+#define TABLE_FILE_VERSION 1
+
+// in a mirrored table, rows that are mirror images of each other share one
+// entry, and this bit of a row index means the mirror image of that entry.
+// transitions use it to mean the orientation changes.
+#define ROW_MIRRORED 0x80000000
+#define ROW_INDEX(row) ((row) & ~ROW_MIRRORED)
+
+// not a row of the table
+#define INVALID_ROW 0xFFFFFFFF
+
+
+typedef struct {
+    uint32_t next_row;
+    uint32_t count;
+} Transition;
 
 typedef struct {
     Bitmap bitmap;
     uint32_t total_transitions;
+
+    // sparse list of the rows that follow this one, with their counts
+    uint32_t num_transitions;
+    uint32_t transitions_capacity;
+    Transition *transitions;
+
+    // running totals of the transition counts, used to sample the next row.
+    // these are only rebuilt for rows touched by training.
+    uint32_t *cumulative;
+    bool dirty;
 } Row;
 
 typedef struct {
     uint32_t row_width;
+    uint32_t bits_per_cell;
+    BitmapKernels kernels;
+    bool mirror;
     uint32_t num_rows;
+    uint32_t rows_capacity;
     Row *rows;
-    uint32_t *transitions;
+
+    // open addressed hash from bitmap to row index
+    uint32_t lookup_capacity;
+    uint32_t *lookup;
+
+    // incremented by every training pass
+    uint32_t version;
+
+    // rows touched during the current training pass
+    uint32_t num_dirty;
+    uint32_t *dirty_rows;
+
+    // training takes this for writing, generators for reading
+    pthread_rwlock_t lock;
+
+    // if not NULL, the runs of rows in every level trained on, so a walk can
+    // avoid copying long runs of them
+    Novelty *novelty;
+
+    // a table compiled into the binary from table_write_source(). its data
+    // is read only, so it can not be trained or destroyed.
+    bool constant;
 } Table;
 
 typedef struct Image {
@@ -25,13 +86,55 @@ typedef struct Image {
 } Image;
 
 
-Table *table_create(uint32_t width, uint32_t height, char const * const level);
+Table *table_create(uint32_t width, uint32_t height, char const * const level, uint32_t flags);
+Table *table_create_empty(uint32_t width, uint32_t bits_per_cell, uint32_t flags);
 void table_destroy(Table **table);
 
+bool table_save(Table *table, char const *file_name);
+Table *table_load(char const *file_name);
+
+// the pieces of a saved table, for writing one without building it in memory
+bool table_write_header(FILE *file, uint32_t width, uint32_t bits_per_cell, uint32_t flags, uint32_t num_rows);
+bool table_write_row(FILE *file, Bitmap bitmap, uint32_t num_transitions, Transition *transitions);
+
+// write the table as C source defining table_embedded(), which returns the
+// same table without parsing, training or allocating anything
+bool table_write_source(Table *table, char const *file_name);
+Table *table_embedded(void);
+
+bool table_train(Table *table, uint32_t height, char const * const level);
+
+// the same, splitting a long level into chunks trained on up to num_threads
+// threads. the table is the same whatever the number of threads.
+bool table_train_threads(Table *table, uint32_t height, char const * const level, uint32_t num_threads);
+
+// build a table row by row, as compaction does. table_add_row() returns the
+// index of a bitmap, adding it if it is new, and table_set_transitions()
+// replaces a row's transitions.
+uint32_t table_add_row(Table *table, Bitmap bitmap);
+void table_set_transitions(Table *table, uint32_t row_index, uint32_t num_transitions, Transition const *transitions);
+
+void table_read_lock(Table *table);
+void table_read_unlock(Table *table);
+
+// a hash of everything a walk depends on- the rows, their transitions, the
+// mirror flag and the novelty index. saved walk state, such as checkpoints,
+// is only reused on a table with the same fingerprint. the caller holds the
+// read lock.
+uint64_t table_fingerprint(Table *table);
+
 uint32_t table_bitmap_index(Table *table, Bitmap bitmap);
-uint32_t table_next_row(Table *table, uint32_t current_row);
+uint32_t table_next_row(Table *table, Rng *rng, uint32_t current_row);
+
+// the same, but when the table has a novelty index, the next row is drawn
+// only from the rows that do not make the walk copy more than max_copy rows
+// of a trained level, unless there are none. match holds the walk's rows
+// up to and including current_row.
+uint32_t table_next_novel_row(Table *table, Rng *rng, uint32_t current_row, NoveltyMatch *match);
 
 void table_copy_row(Table *table, uint32_t current_row, Image *image);
 void table_print(Table *table);
+void table_row_string(Table *table, uint32_t row_index, char *string);
+uint32_t table_find_row(Table *table, char const *string);
 
 #endif
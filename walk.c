@@ -0,0 +1,264 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+#include "rng.h"
+#include "table.h"
+
+#include "walk.h"
+
+
+#define CHECKPOINT_MAGIC "DGC3"
+#define INITIAL_CHECKPOINTS 16
+
+// the bytes of one checkpoint in a file- its rng state, row, and novelty
+// state and length
+#define CHECKPOINT_FILE_SIZE (sizeof(uint64_t) + 3 * sizeof(uint32_t))
+
+
+static void record_checkpoint(Walk *walk);
+static uint32_t table_max_copy(Table *table);
+
+
+void walk_start(Walk *walk, Table *table, uint64_t seed) {
+    rng_seed(&walk->rng, seed);
+    walk->row_index = 0;
+    walk->current_row = rng_next(&walk->rng) % table->num_rows;
+    novelty_start(&walk->match);
+    walk->checkpoints = NULL;
+}
+
+uint32_t walk_next(Walk *walk, Table *table) {
+    if (NULL != walk->checkpoints) {
+        record_checkpoint(walk);
+    }
+
+    uint32_t row = walk->current_row;
+    if (NULL != table->novelty) {
+        novelty_advance(table->novelty, &walk->match, row);
+        walk->current_row = table_next_novel_row(table, &walk->rng, row, &walk->match);
+    } else {
+        walk->current_row = table_next_row(table, &walk->rng, row);
+    }
+    walk->row_index++;
+
+    return row;
+}
+
+// only the next checkpoint past the end of the index is recorded, so
+// walking over already recorded rows does nothing
+static void record_checkpoint(Walk *walk) {
+    Checkpoints *checkpoints = walk->checkpoints;
+
+    if ((walk->row_index % checkpoints->interval) != 0) {
+        return;
+    }
+    if ((walk->row_index / checkpoints->interval) != checkpoints->num_checkpoints) {
+        return;
+    }
+
+    if (checkpoints->num_checkpoints == checkpoints->capacity) {
+        checkpoints->capacity *= 2;
+        checkpoints->checkpoints =
+            (Checkpoint*)realloc(checkpoints->checkpoints, checkpoints->capacity * sizeof(Checkpoint));
+        assert(NULL != checkpoints->checkpoints);
+    }
+
+    Checkpoint *checkpoint = &checkpoints->checkpoints[checkpoints->num_checkpoints];
+    checkpoint->rng_state = walk->rng.state;
+    checkpoint->current_row = walk->current_row;
+    checkpoint->match = walk->match;
+    checkpoints->num_checkpoints++;
+}
+
+bool walk_seek(Walk *walk, Table *table, Checkpoints *checkpoints, uint64_t row_index) {
+    if (!checkpoints_match(checkpoints, table)) {
+        return false;
+    }
+
+    Checkpoints *attached = walk->checkpoints;
+
+    if (checkpoints->num_checkpoints == 0) {
+        walk_start(walk, table, checkpoints->seed);
+    } else {
+        uint64_t checkpoint_index = row_index / checkpoints->interval;
+        if (checkpoint_index >= checkpoints->num_checkpoints) {
+            checkpoint_index = checkpoints->num_checkpoints - 1;
+        }
+
+        Checkpoint *checkpoint = &checkpoints->checkpoints[checkpoint_index];
+        walk->row_index = checkpoint_index * checkpoints->interval;
+        walk->current_row = checkpoint->current_row;
+        walk->rng.state = checkpoint->rng_state;
+        walk->match = checkpoint->match;
+    }
+
+    // walk the rest of the way, filling in checkpoints as we go
+    walk->checkpoints = checkpoints;
+    while (walk->row_index < row_index) {
+        walk_next(walk, table);
+    }
+    walk->checkpoints = attached;
+
+    return true;
+}
+
+// checkpoints taken with and without a novelty index are of different walks
+static uint32_t table_max_copy(Table *table) {
+    return NULL != table->novelty ? table->novelty->max_copy : 0;
+}
+
+Checkpoints *checkpoints_create(Table *table, uint64_t seed, uint32_t interval) {
+    assert(interval > 0);
+
+    Checkpoints *checkpoints = (Checkpoints*)calloc(1, sizeof(Checkpoints));
+    assert(NULL != checkpoints);
+
+    checkpoints->seed = seed;
+    checkpoints->interval = interval;
+    checkpoints->row_width = table->row_width;
+    checkpoints->num_rows = table->num_rows;
+    checkpoints->table_version = table->version;
+    checkpoints->max_copy = table_max_copy(table);
+    checkpoints->fingerprint = table_fingerprint(table);
+    checkpoints->checked = table;
+
+    checkpoints->capacity = INITIAL_CHECKPOINTS;
+    checkpoints->checkpoints = (Checkpoint*)calloc(checkpoints->capacity, sizeof(Checkpoint));
+    assert(NULL != checkpoints->checkpoints);
+
+    return checkpoints;
+}
+
+void checkpoints_destroy(Checkpoints **checkpoints) {
+    free((*checkpoints)->checkpoints);
+    free(*checkpoints);
+    *checkpoints = NULL;
+}
+
+bool checkpoints_match(Checkpoints *checkpoints, Table *table) {
+    // every training pass changes the version, so the fingerprint only has
+    // to be taken once per table and version
+    if ((checkpoints->checked == table) && (checkpoints->table_version == table->version)) {
+        return true;
+    }
+
+    bool match = (checkpoints->row_width == table->row_width) &&
+                 (checkpoints->num_rows == table->num_rows) &&
+                 (checkpoints->table_version == table->version) &&
+                 (checkpoints->max_copy == table_max_copy(table)) &&
+                 (checkpoints->fingerprint == table_fingerprint(table));
+
+    // a damaged file could still point outside the table
+    for (uint32_t index = 0; match && (index < checkpoints->num_checkpoints); index++) {
+        Checkpoint *checkpoint = &checkpoints->checkpoints[index];
+        match = ROW_INDEX(checkpoint->current_row) < table->num_rows;
+        if (NULL != table->novelty) {
+            match = match && (checkpoint->match.state < table->novelty->num_states);
+        }
+    }
+
+    if (match) {
+        checkpoints->checked = table;
+    }
+
+    return match;
+}
+
+// the file is a small header followed by 20 bytes per checkpoint
+bool checkpoints_save(Checkpoints *checkpoints, char const *file_name) {
+    FILE *file = fopen(file_name, "wb");
+    if (NULL == file) {
+        return false;
+    }
+
+    bool ok = true;
+    ok = ok && fwrite(CHECKPOINT_MAGIC, 4, 1, file) == 1;
+    ok = ok && fwrite(&checkpoints->seed, sizeof(uint64_t), 1, file) == 1;
+    ok = ok && fwrite(&checkpoints->interval, sizeof(uint32_t), 1, file) == 1;
+    ok = ok && fwrite(&checkpoints->row_width, sizeof(uint32_t), 1, file) == 1;
+    ok = ok && fwrite(&checkpoints->num_rows, sizeof(uint32_t), 1, file) == 1;
+    ok = ok && fwrite(&checkpoints->table_version, sizeof(uint32_t), 1, file) == 1;
+    ok = ok && fwrite(&checkpoints->max_copy, sizeof(uint32_t), 1, file) == 1;
+    ok = ok && fwrite(&checkpoints->fingerprint, sizeof(uint64_t), 1, file) == 1;
+    ok = ok && fwrite(&checkpoints->num_checkpoints, sizeof(uint32_t), 1, file) == 1;
+
+    for (uint32_t index = 0; ok && (index < checkpoints->num_checkpoints); index++) {
+        Checkpoint *checkpoint = &checkpoints->checkpoints[index];
+        ok = ok && fwrite(&checkpoint->rng_state, sizeof(uint64_t), 1, file) == 1;
+        ok = ok && fwrite(&checkpoint->current_row, sizeof(uint32_t), 1, file) == 1;
+        ok = ok && fwrite(&checkpoint->match.state, sizeof(uint32_t), 1, file) == 1;
+        ok = ok && fwrite(&checkpoint->match.length, sizeof(uint32_t), 1, file) == 1;
+    }
+
+    ok = (0 == fclose(file)) && ok;
+
+    return ok;
+}
+
+Checkpoints *checkpoints_load(char const *file_name) {
+    FILE *file = fopen(file_name, "rb");
+    if (NULL == file) {
+        return NULL;
+    }
+
+    Checkpoints header;
+    memset(&header, 0, sizeof(header));
+
+    char magic[4];
+    bool ok = true;
+    ok = ok && fread(magic, 4, 1, file) == 1 && (0 == memcmp(magic, CHECKPOINT_MAGIC, 4));
+    ok = ok && fread(&header.seed, sizeof(uint64_t), 1, file) == 1;
+    ok = ok && fread(&header.interval, sizeof(uint32_t), 1, file) == 1;
+    ok = ok && fread(&header.row_width, sizeof(uint32_t), 1, file) == 1;
+    ok = ok && fread(&header.num_rows, sizeof(uint32_t), 1, file) == 1;
+    ok = ok && fread(&header.table_version, sizeof(uint32_t), 1, file) == 1;
+    ok = ok && fread(&header.max_copy, sizeof(uint32_t), 1, file) == 1;
+    ok = ok && fread(&header.fingerprint, sizeof(uint64_t), 1, file) == 1;
+    ok = ok && fread(&header.num_checkpoints, sizeof(uint32_t), 1, file) == 1;
+    ok = ok && (header.interval > 0);
+
+    // the count is checked against the rest of the file before anything
+    // is allocated from it
+    long header_end = ftell(file);
+    ok = ok && (header_end >= 0) && (0 == fseek(file, 0, SEEK_END));
+    long file_end = ftell(file);
+    ok = ok && (file_end >= header_end) && (0 == fseek(file, header_end, SEEK_SET));
+    ok = ok && (header.num_checkpoints <= (uint64_t)(file_end - header_end) / CHECKPOINT_FILE_SIZE);
+
+    Checkpoints *checkpoints = NULL;
+    if (ok) {
+        checkpoints = (Checkpoints*)calloc(1, sizeof(Checkpoints));
+        ok = NULL != checkpoints;
+    }
+    if (!ok) {
+        fclose(file);
+        return NULL;
+    }
+    *checkpoints = header;
+
+    checkpoints->capacity = header.num_checkpoints > 0 ? header.num_checkpoints : INITIAL_CHECKPOINTS;
+    checkpoints->checkpoints = (Checkpoint*)calloc(checkpoints->capacity, sizeof(Checkpoint));
+    ok = NULL != checkpoints->checkpoints;
+
+    for (uint32_t index = 0; ok && (index < checkpoints->num_checkpoints); index++) {
+        Checkpoint *checkpoint = &checkpoints->checkpoints[index];
+        ok = ok && fread(&checkpoint->rng_state, sizeof(uint64_t), 1, file) == 1;
+        ok = ok && fread(&checkpoint->current_row, sizeof(uint32_t), 1, file) == 1;
+        ok = ok && fread(&checkpoint->match.state, sizeof(uint32_t), 1, file) == 1;
+        ok = ok && fread(&checkpoint->match.length, sizeof(uint32_t), 1, file) == 1;
+        ok = ok && (ROW_INDEX(checkpoint->current_row) < header.num_rows);
+    }
+
+    fclose(file);
+
+    if (!ok) {
+        checkpoints_destroy(&checkpoints);
+        return NULL;
+    }
+
+    return checkpoints;
+}
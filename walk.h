@@ -0,0 +1,74 @@
+#ifndef DOWNGEN_WALK
+#define DOWNGEN_WALK
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "rng.h"
+#include "table.h"
+
+
+#define DEFAULT_CHECKPOINT_INTERVAL 1024
+
+
+// the state of a walk at row checkpoint_index * interval, before that row
+// is produced
+typedef struct Checkpoint {
+    uint64_t rng_state;
+    uint32_t current_row;
+    NoveltyMatch match;
+} Checkpoint;
+
+// periodic checkpoints of one seeded walk over one version of a table
+typedef struct Checkpoints {
+    uint64_t seed;
+    uint32_t interval;
+
+    // identifies the table the walk was taken over
+    uint32_t row_width;
+    uint32_t num_rows;
+    uint32_t table_version;
+    uint32_t max_copy;
+    uint64_t fingerprint;
+
+    // the table these were last found to match, at table_version. not saved.
+    Table *checked;
+
+    uint32_t num_checkpoints;
+    uint32_t capacity;
+    Checkpoint *checkpoints;
+} Checkpoints;
+
+// a random walk through a table, producing one row of the level at a time
+typedef struct Walk {
+    uint64_t row_index;
+    uint32_t current_row;
+    Rng rng;
+
+    // the rows copied from a trained level, if the table has a novelty index
+    NoveltyMatch match;
+
+    // if not NULL, checkpoints are recorded here as the walk passes them
+    Checkpoints *checkpoints;
+} Walk;
+
+
+void walk_start(Walk *walk, Table *table, uint64_t seed);
+uint32_t walk_next(Walk *walk, Table *table);
+
+// move the walk to the given row, starting from the closest checkpoint at
+// or before it. the rows produced afterwards are the same as if the walk
+// had been run from the start. returns false if the checkpoints do not
+// belong to this table.
+bool walk_seek(Walk *walk, Table *table, Checkpoints *checkpoints, uint64_t row_index);
+
+Checkpoints *checkpoints_create(Table *table, uint64_t seed, uint32_t interval);
+void checkpoints_destroy(Checkpoints **checkpoints);
+// whether the checkpoints were taken over this table, and every one of them
+// is a valid state of a walk over it. the caller holds the read lock.
+bool checkpoints_match(Checkpoints *checkpoints, Table *table);
+
+bool checkpoints_save(Checkpoints *checkpoints, char const *file_name);
+Checkpoints *checkpoints_load(char const *file_name);
+
+#endif